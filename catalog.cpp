@@ -0,0 +1,99 @@
+#include "catalog.h"
+#include <algorithm>
+
+Catalog::Catalog()
+{
+}
+
+Catalog::~Catalog()
+{
+    foreach(const Resident &resident, mResident) {
+        delete resident.movie;
+    }
+}
+
+Catalog::Handle Catalog::add(const FileEntry &file, uint flags)
+{
+    const QByteArray path = file.path.toUtf8();
+    int slot;
+    if (mFree.isEmpty()) {
+        slot = mFlags.size();
+        mPathOffsets.append(mPaths.size());
+        mPathLengths.append(path.size());
+        mFlags.append(flags);
+        mRotations.append(0);
+        mSizes.append(file.size);
+        mCreated.append(file.created);
+        mModified.append(file.modified);
+        mGenerations.append(1); // so 0 is never a valid handle
+    } else {
+        // the old path stays in the arena, it's not worth compacting for
+        slot = mFree.takeLast();
+        mPathOffsets[slot] = mPaths.size();
+        mPathLengths[slot] = path.size();
+        mFlags[slot] = flags;
+        mRotations[slot] = 0;
+        mSizes[slot] = file.size;
+        mCreated[slot] = file.created;
+        mModified[slot] = file.modified;
+        if (slot < mKeyLengths.size())
+            mKeyLengths[slot] = -1;
+    }
+    mPaths.append(path);
+    return (Handle(mGenerations.at(slot)) << 32) | quint32(slot);
+}
+
+void Catalog::remove(Handle handle)
+{
+    release(handle);
+    const int s = slot(handle);
+    mFlags[s] = Removed;
+    ++mGenerations[s];
+    mFree.append(s);
+}
+
+QString Catalog::path(Handle handle) const
+{
+    const int s = slot(handle);
+    return QString::fromUtf8(mPaths.constData() + mPathOffsets.at(s), mPathLengths.at(s));
+}
+
+void Catalog::setNaturalKey(Handle handle, const QByteArray &key)
+{
+    const int s = slot(handle);
+    if (mKeyLengths.size() <= s) {
+        const int old = mKeyLengths.size();
+        mKeyOffsets.resize(mFlags.size());
+        mKeyLengths.resize(mFlags.size());
+        std::fill(mKeyLengths.begin() + old, mKeyLengths.end(), -1);
+    }
+    mKeyOffsets[s] = mKeys.size();
+    mKeyLengths[s] = key.size();
+    mKeys.append(key);
+}
+
+void Catalog::setImage(Handle handle, const QImage &image, qint64 cost)
+{
+    Resident &resident = mResident[slot(handle)];
+    resident.image = image;
+    resident.cost = cost;
+}
+
+void Catalog::setMovie(Handle handle, QMovie *movie, qint64 cost)
+{
+    Resident &resident = mResident[slot(handle)];
+    delete resident.movie;
+    resident.movie = movie;
+    resident.cost = cost;
+}
+
+// Drops the decoded pixels, returns false if there weren't any
+bool Catalog::release(Handle handle)
+{
+    QHash<int, Resident>::iterator it = mResident.find(slot(handle));
+    if (it == mResident.end())
+        return false;
+    delete it->movie;
+    mResident.erase(it);
+    return true;
+}
@@ -0,0 +1,112 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <QtGui>
+#include "threads.h"
+
+// Everything we know about the images, stored column by column so that
+// scanning and sorting millions of entries walks a few dense arrays rather
+// than chasing a heap allocated struct per image. Entries are identified by
+// handles, the display order is kept elsewhere as a list of handles.
+//
+// Paths are kept UTF-8 encoded in one arena. Decoded pixels only exist for
+// the handful of entries around the current image and live in a hash of
+// their own.
+class Catalog
+{
+public:
+    Catalog();
+    ~Catalog();
+
+    // A slot in the low 32 bits and the slot's generation in the high ones.
+    // Slots are reused once an entry is removed, but with a new generation,
+    // so a handle to a removed entry is never mistaken for its successor.
+    // 0 is never a valid handle.
+    typedef quint64 Handle;
+
+    enum Flag {
+        None = 0x0,
+        Failed = 0x1,
+        Seen = 0x2,
+        Network = 0x4,
+        Removed = 0x8
+    };
+
+    Handle add(const FileEntry &file, uint flags = None);
+    void remove(Handle handle);
+    bool contains(Handle handle) const
+    {
+        const int slot = int(handle & 0xffffffff);
+        return slot < mGenerations.size() && mGenerations.at(slot) == quint32(handle >> 32)
+            && !(mFlags.at(slot) & Removed);
+    }
+
+    QString path(Handle handle) const;
+    int pathLength(Handle handle) const { return mPathLengths.at(slot(handle)); } // in bytes
+    const char *pathData(Handle handle, int *length) const
+    {
+        const int s = slot(handle);
+        *length = mPathLengths.at(s);
+        return mPaths.constData() + mPathOffsets.at(s);
+    }
+    uint flags(Handle handle) const { return mFlags.at(slot(handle)); }
+    void setFlags(Handle handle, uint flags) { mFlags[slot(handle)] = flags; }
+    int rotation(Handle handle) const { return mRotations.at(slot(handle)) * 90; }
+    void setRotation(Handle handle, int rotation) { mRotations[slot(handle)] = rotation / 90; }
+    qint64 size(Handle handle) const { return mSizes.at(slot(handle)); }
+    qint64 created(Handle handle) const { return mCreated.at(slot(handle)); }
+    qint64 modified(Handle handle) const { return mModified.at(slot(handle)); }
+
+    // Natural sort keys, see naturalKey() in window.cpp
+    bool hasNaturalKey(Handle handle) const
+    {
+        const int s = slot(handle);
+        return s < mKeyLengths.size() && mKeyLengths.at(s) != -1;
+    }
+    void setNaturalKey(Handle handle, const QByteArray &key);
+    const char *naturalKey(Handle handle, int *length) const
+    {
+        const int s = slot(handle);
+        *length = mKeyLengths.at(s);
+        return mKeys.constData() + mKeyOffsets.at(s);
+    }
+
+    // Decoded pixels. cost() is what's accounted against --cache-mb.
+    QImage image(Handle handle) const { return mResident.value(slot(handle)).image; }
+    QMovie *movie(Handle handle) const { return mResident.value(slot(handle)).movie; }
+    qint64 cost(Handle handle) const { return mResident.value(slot(handle)).cost; }
+    bool isResident(Handle handle) const { return mResident.contains(slot(handle)); }
+    void setImage(Handle handle, const QImage &image, qint64 cost);
+    void setMovie(Handle handle, QMovie *movie, qint64 cost);
+    bool release(Handle handle);
+private:
+    int slot(Handle handle) const
+    {
+        Q_ASSERT(contains(handle));
+        return int(handle & 0xffffffff);
+    }
+
+    struct Resident {
+        Resident() : movie(0), cost(0) {}
+        QImage image;
+        QMovie *movie;
+        qint64 cost;
+    };
+
+    QByteArray mPaths;
+    QVector<qint64> mPathOffsets;
+    QVector<int> mPathLengths;
+    QVector<quint8> mFlags;
+    QVector<quint8> mRotations; // quarter turns
+    QVector<qint64> mSizes, mCreated, mModified;
+    QVector<quint32> mGenerations;
+    QVector<int> mFree;
+
+    QByteArray mKeys;
+    QVector<qint64> mKeyOffsets;
+    QVector<int> mKeyLengths;
+
+    QHash<int, Resident> mResident; // by slot
+};
+
+#endif
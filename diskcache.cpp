@@ -0,0 +1,177 @@
+#include "diskcache.h"
+#include <QCryptographicHash>
+#include <QDirIterator>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <algorithm>
+#include <string.h>
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+enum { Version = 2 }; // 2: images are stored oriented
+
+struct Header {
+    char magic[4];
+    quint32 version;
+    qint32 width, height, bytesPerLine, format;
+    char reserved[40];
+};
+
+#ifdef Q_OS_UNIX
+struct Mapping {
+    void *address;
+    size_t length;
+};
+#endif
+}
+
+static bool isValid(const Header &header, qint64 fileSize)
+{
+    if (memcmp(header.magic, "vp2c", 4) || header.version != Version
+        || header.format <= QImage::Format_Invalid || header.format >= QImage::NImageFormats
+        || header.width <= 0 || header.height <= 0) {
+        return false;
+    }
+    const int depth = QImage::toPixelFormat(static_cast<QImage::Format>(header.format)).bitsPerPixel();
+    return (header.bytesPerLine >= (qint64(header.width) * depth + 7) / 8
+            && header.bytesPerLine % 4 == 0
+            && fileSize >= qint64(sizeof(Header)) + qint64(header.bytesPerLine) * header.height);
+}
+
+#ifdef Q_OS_UNIX
+static void unmap(void *info)
+{
+    Mapping *mapping = static_cast<Mapping*>(info);
+    munmap(mapping->address, mapping->length);
+    delete mapping;
+}
+#endif
+
+QString DiskCache::directory()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/images";
+}
+
+QString DiskCache::path(const QString &fileName, const QSize &size, int rotation)
+{
+    const QFileInfo fi(fileName);
+    if (!fi.exists())
+        return QString();
+    const QString key = fi.absoluteFilePath()
+                        + '\n' + QString::number(fi.lastModified().toMSecsSinceEpoch())
+                        + '\n' + QString::number(fi.size())
+                        + '\n' + QString::number(size.width()) + 'x' + QString::number(size.height())
+                        + '\n' + QString::number(rotation);
+    const QByteArray hash = QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex();
+    return directory() + '/' + QString::fromLatin1(hash.left(2)) + '/' + QString::fromLatin1(hash.mid(2));
+}
+
+// On Unix the returned image points straight into a read-only mapping of
+// the cache file, so its pixels live in the page cache where the kernel can
+// reclaim them, and dropping the last copy of the image unmaps it.
+QImage DiskCache::load(const QString &cacheFile)
+{
+#ifdef Q_OS_UNIX
+    const int fd = ::open(QFile::encodeName(cacheFile).constData(), O_RDONLY|O_CLOEXEC);
+    if (fd == -1)
+        return QImage();
+    struct stat st;
+    void *address = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size >= qint64(sizeof(Header))) {
+        address = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        // the modification time is what prune() goes by
+        futimens(fd, 0);
+    }
+    ::close(fd);
+    if (address == MAP_FAILED)
+        return QImage();
+    const Header *header = static_cast<const Header*>(address);
+    if (!isValid(*header, st.st_size)) {
+        munmap(address, st.st_size);
+        return QImage();
+    }
+    Mapping *mapping = new Mapping;
+    mapping->address = address;
+    mapping->length = st.st_size;
+    return QImage(static_cast<const uchar*>(address) + sizeof(Header), header->width, header->height,
+                  header->bytesPerLine, static_cast<QImage::Format>(header->format), unmap, mapping);
+#else
+    QFile file(cacheFile);
+    if (!file.open(QIODevice::ReadOnly))
+        return QImage();
+    Header header;
+    if (file.read(reinterpret_cast<char*>(&header), sizeof(header)) != sizeof(header)
+        || !isValid(header, file.size())) {
+        return QImage();
+    }
+    QImage image(header.width, header.height, static_cast<QImage::Format>(header.format));
+    if (image.isNull() || image.bytesPerLine() != header.bytesPerLine)
+        return QImage();
+    const qint64 bytes = qint64(header.bytesPerLine) * header.height;
+    if (file.read(reinterpret_cast<char*>(image.bits()), bytes) != bytes)
+        return QImage();
+    file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+    return image;
+#endif
+}
+
+bool DiskCache::store(const QString &cacheFile, const QImage &image)
+{
+    if (image.isNull())
+        return false;
+    QDir().mkpath(QFileInfo(cacheFile).absolutePath());
+    QSaveFile file(cacheFile);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "vp2c", 4);
+    header.version = Version;
+    header.width = image.width();
+    header.height = image.height();
+    header.bytesPerLine = image.bytesPerLine();
+    header.format = image.format();
+    const qint64 bytes = qint64(image.bytesPerLine()) * image.height();
+    if (file.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header)
+        || file.write(reinterpret_cast<const char*>(image.constBits()), bytes) != bytes) {
+        file.cancelWriting();
+        return false;
+    }
+    return file.commit();
+}
+
+// Removes the least recently used entries until the cache fits in maxBytes.
+void DiskCache::prune(qint64 maxBytes)
+{
+    struct Entry {
+        QString path;
+        qint64 size;
+        QDateTime lastUsed;
+    };
+    QList<Entry> entries;
+    qint64 total = 0;
+    QDirIterator it(directory(), QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        it.next();
+        const QFileInfo fi = it.fileInfo();
+        const Entry entry = { fi.absoluteFilePath(), fi.size(), fi.lastModified() };
+        entries.append(entry);
+        total += entry.size;
+    }
+    if (total <= maxBytes)
+        return;
+    std::sort(entries.begin(), entries.end(), [](const Entry &left, const Entry &right) {
+            return left.lastUsed < right.lastUsed;
+        });
+    foreach(const Entry &entry, entries) {
+        if (total <= maxBytes)
+            break;
+        if (QFile::remove(entry.path))
+            total -= entry.size;
+    }
+}
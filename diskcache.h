@@ -0,0 +1,18 @@
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <QtGui>
+
+// Downscaled images, stored as raw pixels under the XDG cache directory so
+// that browsing the same files again doesn't have to decode them again.
+class DiskCache
+{
+public:
+    static QString directory();
+    static QString path(const QString &fileName, const QSize &size, int rotation);
+    static QImage load(const QString &cacheFile);
+    static bool store(const QString &cacheFile, const QImage &image);
+    static void prune(qint64 maxBytes);
+};
+
+#endif
@@ -0,0 +1,234 @@
+#include "exif.h"
+#include <QFile>
+#include <algorithm>
+
+namespace {
+enum {
+    MaxDirectories = 32,
+    MaxEntries = 1024,
+    MaxPreviewSize = 64 * 1024 * 1024
+};
+
+enum Tag {
+    NewSubfileType = 0x00fe,
+    Compression = 0x0103,
+    StripOffsets = 0x0111,
+    Orientation = 0x0112,
+    StripByteCounts = 0x0117,
+    SubIFDs = 0x014a,
+    JPEGInterchangeFormat = 0x0201,
+    JPEGInterchangeFormatLength = 0x0202
+};
+
+struct Preview {
+    Preview() : offset(0), length(0) {}
+    qint64 offset, length;
+};
+
+// Reads a TIFF structure starting at base, which is 0 for raw files and the
+// start of the APP1 payload for JPEGs.
+class Tiff
+{
+public:
+    Tiff(QIODevice *device, qint64 base)
+        : mDevice(device), mBase(base), mBigEndian(false), mOrientation(1)
+    {}
+
+    bool open(quint32 *firstDirectory)
+    {
+        uchar header[8];
+        if (!read(0, header, sizeof(header)))
+            return false;
+        if (header[0] == 'I' && header[1] == 'I') {
+            mBigEndian = false;
+        } else if (header[0] == 'M' && header[1] == 'M') {
+            mBigEndian = true;
+        } else {
+            return false;
+        }
+        if (u16(header + 2) != 42)
+            return false;
+        *firstDirectory = u32(header + 4);
+        return true;
+    }
+
+    // Collects the JPEG previews in the directory at offset, in its sub
+    // directories and in the ones chained after it.
+    void walk(quint32 offset, QList<Preview> *previews)
+    {
+        while (offset && !mVisited.contains(offset) && mVisited.size() < MaxDirectories) {
+            mVisited.insert(offset);
+            const bool first = (mVisited.size() == 1); // IFD0
+            uchar countData[2];
+            if (!read(offset, countData, sizeof(countData)))
+                return;
+            const int count = u16(countData);
+            if (count > MaxEntries)
+                return;
+            QByteArray entries(count * 12, Qt::Uninitialized);
+            uchar *data = reinterpret_cast<uchar*>(entries.data());
+            if (!read(offset + 2, data, entries.size()))
+                return;
+            uchar next[4];
+            const quint32 nextOffset = read(offset + 2 + entries.size(), next, sizeof(next)) ? u32(next) : 0;
+
+            Preview jpeg, strip;
+            quint32 compression = 0, subfileType = 0;
+            QList<quint32> subDirectories;
+            for (int i=0; i<count; ++i) {
+                const uchar *entry = data + (i * 12);
+                const quint16 type = u16(entry + 2);
+                const quint32 values = u32(entry + 4);
+                const quint32 value = (type == 3 ? u16(entry + 8) : u32(entry + 8));
+                switch (u16(entry)) {
+                case NewSubfileType: subfileType = value; break;
+                case Compression: compression = value; break;
+                case Orientation:
+                    if (first)
+                        mOrientation = value;
+                    break;
+                case JPEGInterchangeFormat: jpeg.offset = value; break;
+                case JPEGInterchangeFormatLength: jpeg.length = value; break;
+                case StripOffsets:
+                    if (values == 1)
+                        strip.offset = value;
+                    break;
+                case StripByteCounts:
+                    if (values == 1)
+                        strip.length = value;
+                    break;
+                case SubIFDs:
+                    if (values == 1) {
+                        subDirectories.append(value);
+                    } else if (values <= MaxDirectories) {
+                        QByteArray offsets(values * 4, Qt::Uninitialized);
+                        uchar *o = reinterpret_cast<uchar*>(offsets.data());
+                        if (read(value, o, offsets.size())) {
+                            for (quint32 j=0; j<values; ++j)
+                                subDirectories.append(u32(o + (j * 4)));
+                        }
+                    }
+                    break;
+                }
+            }
+            if (jpeg.offset && jpeg.length) {
+                previews->append(jpeg);
+            } else if (strip.offset && strip.length
+                       && (compression == 6 || (compression == 7 && subfileType == 1))) {
+                // old style JPEG, or a reduced resolution baseline one in
+                // DNGs. Full size compression 7 data is lossless JPEG, which
+                // Qt can't decode.
+                previews->append(strip);
+            }
+            foreach(quint32 sub, subDirectories) {
+                walk(sub, previews);
+            }
+            offset = nextOffset;
+        }
+    }
+
+    // of the main image, which the previews share
+    int orientation() const { return mOrientation; }
+
+    QByteArray data(const Preview &preview)
+    {
+        if (preview.length > MaxPreviewSize || !mDevice->seek(mBase + preview.offset))
+            return QByteArray();
+        const QByteArray ret = mDevice->read(preview.length);
+        return ret.size() == preview.length ? ret : QByteArray();
+    }
+private:
+    bool read(quint32 offset, uchar *data, qint64 size)
+    {
+        return mDevice->seek(mBase + offset)
+            && mDevice->read(reinterpret_cast<char*>(data), size) == size;
+    }
+    quint16 u16(const uchar *data) const
+    {
+        return mBigEndian ? qFromBigEndian<quint16>(data) : qFromLittleEndian<quint16>(data);
+    }
+    quint32 u32(const uchar *data) const
+    {
+        return mBigEndian ? qFromBigEndian<quint32>(data) : qFromLittleEndian<quint32>(data);
+    }
+
+    QIODevice *mDevice;
+    const qint64 mBase;
+    bool mBigEndian;
+    int mOrientation;
+    QSet<quint32> mVisited;
+};
+
+// Turns image the way the EXIF orientation says and then by rotation
+QImage orient(const QImage &image, int orientation, int rotation)
+{
+    QImage ret = image;
+    switch (orientation) {
+    case 2: ret = ret.mirrored(true, false); break;
+    case 3: rotation += 180; break;
+    case 4: ret = ret.mirrored(false, true); break;
+    case 5: ret = ret.mirrored(false, true); rotation += 90; break;
+    case 6: rotation += 90; break;
+    case 7: ret = ret.mirrored(true, false); rotation += 90; break;
+    case 8: rotation += 270; break;
+    default: break;
+    }
+    rotation %= 360;
+    if (rotation) {
+        QTransform transform;
+        transform.rotate(rotation);
+        ret = ret.transformed(transform);
+    }
+    return ret;
+}
+
+// Where the TIFF structure in a JPEG's APP1 Exif segment starts, or -1
+qint64 exifOffset(QIODevice *device)
+{
+    uchar marker[4];
+    qint64 pos = 2;
+    while (device->seek(pos) && device->read(reinterpret_cast<char*>(marker), 4) == 4) {
+        if (marker[0] != 0xff || marker[1] == 0xda) // start of scan, no more headers
+            break;
+        const int length = qFromBigEndian<quint16>(marker + 2);
+        if (marker[1] == 0xe1 && device->read(6) == QByteArray("Exif\0\0", 6))
+            return pos + 10;
+        pos += 2 + length;
+    }
+    return -1;
+}
+}
+
+QImage Exif::thumbnail(const QString &fileName, int rotation)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return QImage();
+    const QByteArray magic = file.read(2);
+    qint64 base;
+    if (magic == "\xff\xd8") {
+        base = exifOffset(&file);
+    } else if (magic == "II" || magic == "MM") {
+        base = 0;
+    } else {
+        return QImage();
+    }
+    if (base == -1)
+        return QImage();
+
+    Tiff tiff(&file, base);
+    quint32 first;
+    if (!tiff.open(&first))
+        return QImage();
+    QList<Preview> previews;
+    tiff.walk(first, &previews);
+    std::sort(previews.begin(), previews.end(), [](const Preview &left, const Preview &right) {
+            return left.length > right.length;
+        });
+    foreach(const Preview &preview, previews) {
+        const QImage image = QImage::fromData(tiff.data(preview), "JPEG");
+        if (!image.isNull())
+            return orient(image, tiff.orientation(), rotation);
+    }
+    return QImage();
+}
@@ -0,0 +1,18 @@
+#ifndef EXIF_H
+#define EXIF_H
+
+#include <QtGui>
+
+// Finds the previews cameras embed in their files by walking the TIFF
+// directories in the file header, without decoding the image itself. For
+// JPEGs that's the EXIF thumbnail, for TIFF based raw formats (CR2, NEF,
+// DNG, ...) the largest JPEG preview.
+class Exif
+{
+public:
+    // Oriented like the image is, by its EXIF orientation and then by
+    // rotation degrees
+    static QImage thumbnail(const QString &fileName, int rotation = 0);
+};
+
+#endif
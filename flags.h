@@ -24,7 +24,9 @@ public:
         DisplayFileName = 0x000200,
         DisplayThumbnails = 0x000400,
         HidePointer = 0x000800,
-        XKludge = 0x001000
+        XKludge = 0x001000,
+        UseDiskCache = 0x002000,
+        PendingSort = 0x004000
     };
 
     bool test(Flag flag) const {
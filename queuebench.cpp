@@ -0,0 +1,42 @@
+// Times ImageLoaderThread's queue operations with 1k and 10k pending
+// requests. No workers are started, so everything stays queued and each
+// remove() or reprioritize() call is spent holding mMutex, uncontended.
+#include "threads.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <stdio.h>
+#include <stdlib.h>
+
+static void bench(int count)
+{
+    ImageLoaderThread loader;
+    for (int i=0; i<count; ++i)
+        loader.load(new QImageReader(QString()), ImageLoaderThread::None, 0, i + 1, QSize(), rand() % count);
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i=0; i<count; ++i)
+        loader.reprioritize(i + 1, rand() % count, 0);
+    const qint64 reprioritize = timer.nsecsElapsed();
+
+    // each one is put back afterwards so the queue stays at count
+    qint64 remove = 0;
+    for (int i=0; i<count; ++i) {
+        timer.restart();
+        loader.remove(i + 1);
+        remove += timer.nsecsElapsed();
+        loader.load(new QImageReader(QString()), ImageLoaderThread::None, 0, i + 1, QSize(), rand() % count);
+    }
+
+    printf("%6d pending: reprioritize %6.0f ns, remove %6.0f ns per call\n",
+           count, double(reprioritize) / count, double(remove) / count);
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    srand(0);
+    bench(1000);
+    bench(10000);
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include "searchindex.h"
+#include <algorithm>
+#include <string.h>
+
+SearchIndex::SearchIndex()
+{
+    mOffsets.append(0);
+}
+
+void SearchIndex::append(const QString &path)
+{
+    mArena.append(path.toCaseFolded().toUtf8());
+    mArena.append('\0');
+    mOffsets.append(mArena.size());
+}
+
+void SearchIndex::clear()
+{
+    mArena.clear();
+    mOffsets.resize(1);
+}
+
+// Returns the offset of the first match in [from, to) or -1. The needle
+// never contains '\0' so a match can't span two paths.
+qint64 SearchIndex::find(const QByteArray &needle, qint64 from, qint64 to) const
+{
+    const char *begin = mArena.constData() + from;
+#ifdef Q_OS_UNIX
+    const void *match = memmem(begin, to - from, needle.constData(), needle.size());
+    return match ? static_cast<const char*>(match) - mArena.constData() : -1;
+#else
+    const char *end = mArena.constData() + to;
+    const char *match = std::search(begin, end, needle.constData(), needle.constData() + needle.size());
+    return match == end ? -1 : match - mArena.constData();
+#endif
+}
+
+int SearchIndex::indexAt(qint64 offset) const
+{
+    return std::upper_bound(mOffsets.constBegin(), mOffsets.constEnd(), offset) - mOffsets.constBegin() - 1;
+}
+
+int SearchIndex::indexOf(const QString &string, int from) const
+{
+    const QByteArray needle = string.toCaseFolded().toUtf8();
+    if (needle.isEmpty() || from < 0 || from >= size())
+        return -1;
+    const qint64 match = find(needle, mOffsets.at(from), mArena.size());
+    return match == -1 ? -1 : indexAt(match);
+}
+
+// There's no reverse memmem so this goes backwards a block of paths at a
+// time and takes the last match within the first block that has one.
+int SearchIndex::lastIndexOf(const QString &string, int from) const
+{
+    const QByteArray needle = string.toCaseFolded().toUtf8();
+    if (needle.isEmpty() || from < 0)
+        return -1;
+    enum { BlockSize = 1024 };
+    int end = qMin(from + 1, size());
+    while (end > 0) {
+        const int begin = qMax(0, end - BlockSize);
+        int found = -1;
+        qint64 offset = mOffsets.at(begin);
+        qint64 match;
+        while ((match = find(needle, offset, mOffsets.at(end))) != -1) {
+            found = indexAt(match);
+            offset = mOffsets.at(found + 1);
+        }
+        if (found != -1)
+            return found;
+        end = begin;
+    }
+    return -1;
+}
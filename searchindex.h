@@ -0,0 +1,29 @@
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+
+#include <QtCore>
+
+// Case folded copies of the paths, in display order, one after the other in
+// a single buffer so a search is one memmem over contiguous memory rather
+// than a QString::contains per path. Paths are only ever appended, anything
+// that reorders the list clears the index and it's rebuilt on the next
+// search.
+class SearchIndex
+{
+public:
+    SearchIndex();
+    void append(const QString &path);
+    void clear();
+    int size() const { return mOffsets.size() - 1; }
+
+    int indexOf(const QString &string, int from) const;
+    int lastIndexOf(const QString &string, int from) const;
+private:
+    qint64 find(const QByteArray &needle, qint64 from, qint64 to) const;
+    int indexAt(qint64 offset) const;
+
+    QByteArray mArena; // paths separated by '\0'
+    QVector<qint64> mOffsets; // where each path starts, plus the end
+};
+
+#endif
@@ -1,95 +1,260 @@
 #include "threads.h"
+#include "diskcache.h"
+#include "exif.h"
+#include "tiffregion.h"
 #include <QSet>
 #include <QFileInfo>
 #include <QImageReader>
 #include <QDirIterator>
 #include <QDebug>
+#include <string.h>
 #ifdef MAGICK_ENABLED
 #include <Magick++/Image.h>
 #include <Magick++/Geometry.h>
 #endif
+#ifdef Q_OS_LINUX
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Reads from the file fail once the request that opened it has gone stale,
+// which makes the image handler bail out of an in-flight decode early.
+class CancellableFile : public QFile
+{
+public:
+    CancellableFile(const QString &fileName, const QAtomicInt *generation, const QAtomicInt *current)
+        : QFile(fileName), mGeneration(generation), mCurrent(current), mCancelled(false)
+    {}
+
+    bool isCancelled() const { return mCancelled; }
+protected:
+    qint64 readData(char *data, qint64 maxSize)
+    {
+        if (mCancelled || mGeneration->loadAcquire() < mCurrent->loadAcquire()) {
+            mCancelled = true;
+            return -1;
+        }
+        return QFile::readData(data, maxSize);
+    }
+private:
+    const QAtomicInt *mGeneration, *mCurrent;
+    bool mCancelled;
+};
+
+// Rotates image by a multiple of 90 degrees and, if size isn't empty, fast
+// scales it to fit in the same pass
+static QImage orient(const QImage &image, int rotation, const QSize &size)
+{
+    if (image.isNull() || (!rotation && size.isEmpty()))
+        return image;
+    const bool quarter = (rotation % 180 == 90);
+    QTransform transform;
+    if (!size.isEmpty()) {
+        // the size to scale to, in the orientation the image has now
+        QSize target = (quarter ? image.size().transposed() : image.size()).scaled(size, Qt::KeepAspectRatio);
+        if (quarter)
+            target.transpose();
+        transform.scale(double(target.width()) / image.width(), double(target.height()) / image.height());
+    }
+    transform.rotate(rotation);
+    return image.transformed(transform, Qt::FastTransformation);
+}
+
+// Whether the image ends up turned by a quarter relative to how it's stored
+static inline bool isQuarterTurned(const QImageReader &reader, int rotation)
+{
+    return (rotation % 180 == 90) != bool(reader.transformation() & QImageIOHandler::TransformationRotate90);
+}
+
+// A quick look at big JPEGs while the real decode runs, libjpeg decodes at
+// 1/8 scale straight from the DCT coefficients for a fraction of the cost.
+// size is what the full decode will come out as.
+static QImage readPreview(const QString &fileName, const QSize &target, int rotation, QSize *size)
+{
+    enum { MinimumPixels = 4 * 1024 * 1024 };
+    QImageReader reader(fileName);
+    reader.setAutoTransform(true);
+    if (reader.format() != "jpeg")
+        return QImage();
+    const QSize original = reader.size();
+    if (qint64(original.width()) * original.height() < MinimumPixels)
+        return QImage();
+    *size = isQuarterTurned(reader, rotation) ? original.transposed() : original;
+    if (!target.isEmpty())
+        size->scale(target, Qt::KeepAspectRatio);
+    // rounded down, rounding up makes the JPEG handler pick 1/4 instead
+    reader.setScaledSize(QSize(qMax(1, original.width() / 8), qMax(1, original.height() / 8)));
+    return orient(reader.read(), rotation, QSize());
+}
 
 ImageLoaderThread::ImageLoaderThread()
-    : mFirst(0), mLast(0), mAborted(false), mPending(0)
+    : mSequence(0), mGeneration(0), mAborted(false)
 {
 }
 
 ImageLoaderThread::~ImageLoaderThread()
 {
+    abort();
+    wait();
+    qDeleteAll(mWorkers);
     clear();
 }
 
-void ImageLoaderThread::load(QImageReader *reader, uint flags, int rotation, void *userData, const QSize &size)
+void ImageLoaderThread::start(int threadCount)
+{
+    Q_ASSERT(mWorkers.isEmpty());
+    threadCount = qMax(1, threadCount);
+    for (int i=0; i<threadCount; ++i) {
+        Worker *worker = new Worker(this);
+        mWorkers.append(worker);
+        worker->start();
+    }
+}
+
+void ImageLoaderThread::wait()
+{
+    foreach(Worker *worker, mWorkers) {
+        worker->wait();
+    }
+}
+
+void ImageLoaderThread::load(QImageReader *reader, uint flags, int rotation, quint64 id,
+                             const QSize &size, int priority)
 {
     Q_ASSERT(reader);
     Node *node = new Node;
-    node->next = 0;
     node->flags = flags;
     node->rotation = rotation % 360;
+    reader->setAutoTransform(true); // EXIF orientation
     node->size = size;
     node->reader = reader;
-    node->userData = userData;
-    if (rotation % 180 == 90)
-        qSwap(node->size.rwidth(), node->size.rheight());
+    if (!qobject_cast<QFile*>(reader->device()))
+        node->device = reader->device(); // e.g. a QBuffer with downloaded data, ours now
+    node->id = id;
+    node->priority = priority;
     QMutexLocker lock(&mMutex);
-    ++mPending;
-    Q_ASSERT(!mFirst == !mLast);
-    if (!mFirst) {
-        mFirst = mLast = node;
-    } else {
-        Q_ASSERT(mLast && mFirst);
-        if (flags & HighPriority) {
-            node->next = mFirst;
-            mFirst = node;
-        } else {
-            Q_ASSERT(mLast);
-            mLast->next = node;
-            mLast = node;
-        }
+    node->generation.storeRelease(mGeneration.loadAcquire());
+    // HighPriority requests are taken newest first, the rest in the order
+    // they came in
+    ++mSequence;
+    node->sequence = (flags & HighPriority) ? -mSequence : mSequence;
+    if (Node *old = mQueued.value(id)) {
+        takeAt(old->heapIndex);
+        delete old;
     }
+    mQueued[id] = node;
+    node->heapIndex = mQueue.size();
+    mQueue.append(node);
+    siftUp(node->heapIndex);
     mWaitCondition.wakeOne();
 }
 
-bool ImageLoaderThread::remove(void *userData)
+void ImageLoaderThread::siftUp(int index)
+{
+    Node *node = mQueue.at(index);
+    while (index > 0) {
+        const int parent = (index - 1) / 2;
+        Node *p = mQueue.at(parent);
+        if (!lessThan(node, p))
+            break;
+        mQueue[index] = p;
+        p->heapIndex = index;
+        index = parent;
+    }
+    mQueue[index] = node;
+    node->heapIndex = index;
+}
+
+void ImageLoaderThread::siftDown(int index)
+{
+    const int size = mQueue.size();
+    Node *node = mQueue.at(index);
+    forever {
+        int child = (index * 2) + 1;
+        if (child >= size)
+            break;
+        if (child + 1 < size && lessThan(mQueue.at(child + 1), mQueue.at(child)))
+            ++child;
+        Node *c = mQueue.at(child);
+        if (!lessThan(c, node))
+            break;
+        mQueue[index] = c;
+        c->heapIndex = index;
+        index = child;
+    }
+    mQueue[index] = node;
+    node->heapIndex = index;
+}
+
+// Called with mMutex held. Removes the node from the heap but does not delete it.
+void ImageLoaderThread::takeAt(int index)
+{
+    Q_ASSERT(index >= 0 && index < mQueue.size());
+    Node *node = mQueue.at(index);
+    mQueued.remove(node->id);
+    node->heapIndex = -1;
+    Node *last = mQueue.takeLast();
+    if (last != node) {
+        mQueue[index] = last;
+        last->heapIndex = index;
+        siftDown(index);
+        siftUp(last->heapIndex);
+    }
+}
+
+bool ImageLoaderThread::remove(quint64 id)
 {
     QMutexLocker lock(&mMutex);
-    Node *prev = 0;
-    Node *n = mFirst;
-    while (n && n->userData != userData) {
-        prev = n;
-        n = n->next;
-    }
-    if (n) {
-        if (n == mFirst && n == mLast) {
-            mFirst = mLast = 0;
-        } else if (n == mLast) {
-            mLast = prev;
-            mLast->next = 0;
-        } else if (n == mFirst) {
-            mFirst = n->next;
-            Q_ASSERT(!prev);
-            Q_ASSERT(mFirst);
-        } else {
-            prev->next = n->next;
+    Node *node = mQueued.value(id);
+    if (node) {
+        takeAt(node->heapIndex);
+        delete node;
+    }
+    foreach(Node *n, mActive) {
+        if (n->id == id)
+            n->generation.storeRelease(-1); // stale, its result is dropped
+    }
+    return node;
+}
+
+void ImageLoaderThread::reprioritize(quint64 id, int priority, int generation, uint flags)
+{
+    QMutexLocker lock(&mMutex);
+    if (Node *node = mQueued.value(id)) {
+        node->generation.storeRelease(generation);
+        node->flags |= flags;
+        if (node->priority != priority) {
+            const bool up = priority < node->priority;
+            node->priority = priority;
+            if (up) {
+                siftUp(node->heapIndex);
+            } else {
+                siftDown(node->heapIndex);
+            }
         }
-        --mPending;
-        delete n;
     }
-    mWaitCondition.wakeOne();
-    return n;
+    foreach(Node *n, mActive) {
+        // ones remove() gave up on stay dropped, a reload is queued instead
+        if (n->id == id && n->generation.loadAcquire() != -1)
+            n->generation.storeRelease(generation);
+    }
+}
+
+void ImageLoaderThread::setGeneration(int generation)
+{
+    mGeneration.storeRelease(generation);
 }
 
 
 void ImageLoaderThread::clear()
 {
     QMutexLocker lock(&mMutex);
-    while (mFirst) {
-        Node *n = mFirst;
-        mFirst = mFirst->next;
-        delete n;
-    }
-    mPending = 0;
-    mFirst = mLast = 0;
+    qDeleteAll(mQueue);
+    mQueue.clear();
+    mQueued.clear();
 }
 
 
@@ -100,20 +265,23 @@ void ImageLoaderThread::run()
         {
             QMutexLocker lock(&mMutex);
             while (!node) {
-                if (mFirst) {
-                    node = mFirst;
-                    mFirst = mFirst->next;
-                    if (!mFirst)
-                        mLast = 0;
+                if (!mQueue.isEmpty()) {
+                    node = mQueue.first();
+                    takeAt(0);
                 } else {
                     mWaitCondition.wait(&mMutex);
                     if (mAborted)
                         return;
                 }
             }
-            --mPending;
+            mActive.append(node);
         }
         QImage img;
+        CancellableFile *file = 0;
+        const bool skipped = isStale(node);
+        if (skipped) {
+            // nobody wants this one anymore
+        } else
 #ifdef MAGICK_ENABLED
         if (node->path.endsWith(".pdf", Qt::CaseInsensitive)) {
             try {
@@ -126,68 +294,378 @@ void ImageLoaderThread::run()
                     }
                     img = QImage(pdf.columns(), pdf.rows(), QImage::Format_RGB32);
                     pdf.write(0, 0, img.width(), img.height(), "RGB", Magick::CharPixel, img.bits());
+                    img = orient(img, node->rotation, QSize());
                 }
             } catch (...) {
             }
         } else
 #endif
         {
-            QSize size;
-            if (!node->size.isEmpty()) {
-                size = node->reader->size();
-                size.scale(node->size, Qt::KeepAspectRatio);
-                if (!(node->flags & NoSmoothScale))
-                    node->reader->setScaledSize(size);
+            const QString fileName = node->reader->fileName();
+            QString cacheFile;
+            if (node->flags & CacheToDisk && !fileName.isEmpty() && !node->size.isEmpty()) {
+                cacheFile = DiskCache::path(fileName, node->size, node->rotation);
+                if (!cacheFile.isEmpty())
+                    img = DiskCache::load(cacheFile);
             }
-            if (node->reader->read(&img) && (node->flags & NoSmoothScale) && !size.isNull()) {
-                img = img.scaled(size);
+            if (img.isNull()) {
+                if (node->flags & Preview && !fileName.isEmpty()) {
+                    QSize size;
+                    const QImage preview = readPreview(fileName, node->size, node->rotation, &size);
+                    if (!preview.isNull() && !isStale(node))
+                        emit imagePreview(node->id, toDisplayFormat(preview), size);
+                }
+                if (!fileName.isEmpty()) {
+                    file = new CancellableFile(fileName, &node->generation, &mGeneration);
+                    node->device = file;
+                    if (file->open(QIODevice::ReadOnly))
+                        node->reader->setDevice(file);
+                }
+                // node->size is how the image is shown, the decoder scales
+                // it the way it's stored and the reader applies the EXIF
+                // orientation afterwards
+                const bool smooth = !(node->flags & NoSmoothScale);
+                if (!node->size.isEmpty() && smooth) {
+                    QSize size = node->reader->size();
+                    size.scale(isQuarterTurned(*node->reader, node->rotation)
+                               ? node->size.transposed() : node->size, Qt::KeepAspectRatio);
+                    node->reader->setScaledSize(size);
+                }
+                if (node->reader->read(&img)) {
+                    // converted once here rather than by every paint, the
+                    // rotation then stays in a 32 bit format
+                    img = orient(toDisplayFormat(img), node->rotation, smooth ? QSize() : node->size);
+                }
+                bool complete = false;
+                if (!cacheFile.isEmpty() && !img.isNull()) {
+                    // a cancelled read can still "succeed" with a truncated
+                    // image, that must never end up in the cache
+                    QMutexLocker lock(&mMutex);
+                    complete = !isStale(node) && !(file && file->isCancelled());
+                }
+                if (complete && DiskCache::store(cacheFile, img)) {
+                    // swap the heap copy for one backed by the cache file
+                    const QImage mapped = DiskCache::load(cacheFile);
+                    if (!mapped.isNull())
+                        img = mapped;
+                }
             }
         }
-        if (img.isNull()) {
-            emit loadError(node->userData);
+        if (!img.isNull())
+            img = toDisplayFormat(img);
+        bool stale;
+        {
+            QMutexLocker lock(&mMutex);
+            mActive.removeOne(node);
+            stale = skipped || isStale(node) || (file && file->isCancelled());
+        }
+        if (stale) {
+            // dropped silently, Window has already forgotten about it
+        } else if (img.isNull()) {
+            emit loadError(node->id);
         } else {
-            emit imageLoaded(node->userData, img);
+            emit imageLoaded(node->id, img);
         }
         delete node;
     }
 }
 
+QImage ImageLoaderThread::toDisplayFormat(const QImage &image)
+{
+    const QImage::Format format = (image.hasAlphaChannel()
+                                   ? QImage::Format_ARGB32_Premultiplied
+                                   : QImage::Format_RGB32);
+    return image.format() == format ? image : image.convertToFormat(format);
+}
+
 void ImageLoaderThread::abort()
 {
     QMutexLocker locker(&mMutex);
     mAborted = true;
-    mWaitCondition.wakeOne();
+    mWaitCondition.wakeAll();
+}
+
+class ThumbLoader::Task : public QRunnable
+{
+public:
+    Task(ThumbLoader *loader, quint64 i, int w, const QImage &im, const QString &file, int r)
+        : loader(loader), id(i), width(w), image(im), fileName(file), rotation(r), cancelled(false)
+    {}
+    void run();
+
+    ThumbLoader *loader;
+    const quint64 id;
+    const int width;
+    const QImage image;
+    const QString fileName;
+    const int rotation;
+    bool cancelled; // protected by the loader's mutex
+};
+
+void ThumbLoader::Task::run()
+{
+    {
+        QMutexLocker lock(&loader->mMutex);
+        if (cancelled)
+            return;
+    }
+    QImage thumb;
+    if (!image.isNull()) {
+        thumb = image.scaledToWidth(width);
+    } else {
+        thumb = Exif::thumbnail(fileName, rotation);
+        if (!thumb.isNull())
+            thumb = thumb.scaledToWidth(width);
+    }
+    if (!thumb.isNull())
+        thumb = ImageLoaderThread::toDisplayFormat(thumb);
+    loader->finish(this, thumb);
 }
 
-ThumbLoaderThread::ThumbLoaderThread(const QImage &image, int w)
-    : QThread(), original(image), width(w)
+ThumbLoader::ThumbLoader()
 {
-    Q_ASSERT(!image.isNull());
+    mPool.setMaxThreadCount(2); // one for each side
 }
 
-void ThumbLoaderThread::run()
+ThumbLoader::~ThumbLoader()
 {
-    const QImage thumb = original.scaledToWidth(width);
-    emit thumbLoaded(thumb);
+    clear();
+    mPool.waitForDone();
+}
+
+void ThumbLoader::request(quint64 id, int width, const QImage &image, const QString &fileName, int rotation)
+{
+    Q_ASSERT(!image.isNull() || !fileName.isEmpty());
+    const Key key(id, width);
+    QMutexLocker lock(&mMutex);
+    Task *&task = mTasks[key];
+    if (task) {
+        if (image.isNull() || !task->image.isNull())
+            return;
+        task->cancelled = true;
+    }
+    task = new Task(this, id, width, image, fileName, rotation);
+    mPool.start(task);
+}
+
+void ThumbLoader::cancel(quint64 id, int width)
+{
+    QMutexLocker lock(&mMutex);
+    if (Task *task = mTasks.take(Key(id, width)))
+        task->cancelled = true;
+}
+
+void ThumbLoader::clear()
+{
+    QMutexLocker lock(&mMutex);
+    foreach(Task *task, mTasks)
+        task->cancelled = true;
+    mTasks.clear();
+}
+
+void ThumbLoader::finish(Task *task, const QImage &thumb)
+{
+    {
+        QMutexLocker lock(&mMutex);
+        if (task->cancelled)
+            return;
+        mTasks.remove(Key(task->id, task->width));
+    }
+    emit thumbLoaded(task->id, task->width, thumb, task->image.isNull());
+}
+
+class TileLoader::Task : public QRunnable
+{
+public:
+    Task(TileLoader *loader, const TileKey &k, const QString &file, const QSize &s)
+        : loader(loader), key(k), fileName(file), size(s), cancelled(false)
+    {}
+    void run();
+
+    TileLoader *loader;
+    const TileKey key;
+    const QString fileName;
+    const QSize size;
+    bool cancelled; // protected by the loader's mutex
+};
+
+void TileLoader::Task::run()
+{
+    {
+        QMutexLocker lock(&loader->mMutex);
+        if (cancelled)
+            return;
+    }
+    const QRect rect = tileRect(key, size);
+    const int scale = 1 << key.level;
+    QImageReader reader(fileName);
+    QImage tile;
+    if (reader.supportsOption(QImageIOHandler::ClipRect)) {
+        reader.setClipRect(QRect(rect.topLeft() * scale, rect.size() * scale) & QRect(QPoint(), size));
+        reader.setScaledSize(rect.size());
+        tile = reader.read();
+    } else if (TiffRegion::canRead(fileName)) {
+        tile = TiffRegion::read(fileName, QRect(rect.topLeft() * scale, rect.size() * scale), scale);
+    } else {
+        QMutexLocker decoding(&loader->mLevelMutex);
+        const TileKey levelKey = { key.id, key.level, 0, 0 };
+        QImage level;
+        bool decoded = false; // including ones that failed
+        {
+            QMutexLocker lock(&loader->mMutex);
+            if (cancelled)
+                return;
+            if (loader->mLevelKey == levelKey) {
+                level = loader->mLevel;
+                decoded = true;
+            }
+        }
+        if (!decoded) {
+            reader.setScaledSize(QSize((size.width() + scale - 1) / scale, (size.height() + scale - 1) / scale));
+            level = reader.read();
+            if (!level.isNull())
+                level = ImageLoaderThread::toDisplayFormat(level);
+            QMutexLocker lock(&loader->mMutex);
+            if (!cancelled) {
+                loader->mLevel = level;
+                loader->mLevelKey = levelKey;
+            }
+        }
+        tile = level.copy(rect);
+    }
+    if (!tile.isNull())
+        tile = ImageLoaderThread::toDisplayFormat(tile);
+    loader->finish(this, tile);
+}
+
+TileLoader::TileLoader()
+{
+    mLevelKey.id = 0; // no handle is 0
+    mLevelKey.level = mLevelKey.column = mLevelKey.row = 0;
+}
+
+TileLoader::~TileLoader()
+{
+    clear();
+    mPool.waitForDone();
+}
+
+void TileLoader::request(const TileKey &key, const QString &fileName, const QSize &size)
+{
+    QMutexLocker lock(&mMutex);
+    Task *&task = mTasks[key];
+    if (!task) {
+        task = new Task(this, key, fileName, size);
+        mPool.start(task);
+    }
+}
+
+void TileLoader::clear()
+{
+    QMutexLocker lock(&mMutex);
+    foreach(Task *task, mTasks)
+        task->cancelled = true;
+    mTasks.clear();
+    mLevel = QImage();
+    mLevelKey.id = 0;
+}
+
+QRect TileLoader::tileRect(const TileKey &key, const QSize &size)
+{
+    const int scale = 1 << key.level;
+    const QRect level(0, 0, (size.width() + scale - 1) / scale, (size.height() + scale - 1) / scale);
+    return QRect(key.column * TileSize, key.row * TileSize, TileSize, TileSize) & level;
+}
+
+void TileLoader::finish(Task *task, const QImage &tile)
+{
+    {
+        QMutexLocker lock(&mMutex);
+        if (task->cancelled)
+            return;
+        mTasks.remove(task->key);
+    }
+    emit tileLoaded(task->key, tile);
 }
 
 FileNameThread::FileNameThread(const QString &dir, /*int min, int max, */const QRegExp &rx, const QRegExp &irx, bool detect, bool rec)
     : QThread(), directory(dir), /*minDepth(min), maxDepth(max), */aborted(false),
       regexp(rx), ignore(irx), detectFileName(detect), recurse(rec),
-      minSize(-1), maxSize(-1)
+      minSize(-1), maxSize(-1), maxThreads(1), statFiles(false)
 {
 }
 
+void FileEntry::read(const QFileInfo &fi)
+{
+    size = fi.size();
+    modified = fi.lastModified().toMSecsSinceEpoch();
+    const QDateTime birthTime = fi.birthTime();
+    created = birthTime.isValid() ? birthTime.toMSecsSinceEpoch() : modified;
+}
 
-static inline int matchSize(int min, int max, const QFileInfo &fi)
+
+static inline int matchSize(int min, int max, qint64 size)
 {
-    if ((min != -1 && fi.size() < min * 1024) || (max != -1 && fi.size() > max * 1024)) {
+    if ((min != -1 && size < min * 1024) || (max != -1 && size > max * 1024)) {
         return false;
     } else {
         return true;
     }
 }
 
+static inline int matchSize(int min, int max, const QFileInfo &fi)
+{
+    if (min == -1 && max == -1)
+        return true;
+    return matchSize(min, max, fi.size());
+}
+
+#ifdef Q_OS_LINUX
+static inline qint64 msecs(qint64 sec, qint64 nsec)
+{
+    return (sec * 1000) + (nsec / 1000000);
+}
+
+// Follows links, like QFileInfo
+static inline bool statFile(int dirfd, const char *name, FileEntry *file)
+{
+#ifdef STATX_SIZE
+    struct statx stx;
+    if (!statx(dirfd, name, AT_STATX_DONT_SYNC, STATX_SIZE|STATX_MTIME|STATX_BTIME, &stx)
+        && stx.stx_mask & STATX_SIZE) {
+        file->size = stx.stx_size;
+        file->modified = msecs(stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec);
+        if (stx.stx_mask & STATX_BTIME) {
+            file->created = msecs(stx.stx_btime.tv_sec, stx.stx_btime.tv_nsec);
+        } else {
+            file->created = file->modified;
+        }
+        return true;
+    }
+#endif
+    struct stat st;
+    if (fstatat(dirfd, name, &st, 0))
+        return false;
+    file->size = st.st_size;
+    file->created = file->modified = msecs(st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    return true;
+}
+
+// Only reads the header, relative to the directory we're scanning anyway
+static inline bool canLoad(int dirfd, const char *name, const QString &absoluteFilePath)
+{
+    const int fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+    if (fd != -1) {
+        char header[32];
+        const ssize_t bytes = pread(fd, header, sizeof(header), 0);
+        ::close(fd);
+        if (bytes >= 0)
+            return ImageLoaderThread::canLoad(absoluteFilePath, header, bytes);
+    }
+    return ImageLoaderThread::canLoad(absoluteFilePath);
+}
+#endif
+
 bool FileNameThread::matches(const QString &absoluteFilePath) const
 {
     return (regexp.isEmpty() || absoluteFilePath.contains(regexp))
@@ -196,38 +674,206 @@ bool FileNameThread::matches(const QString &absoluteFilePath) const
 
 void FileNameThread::run()
 {
-    QSet<QString> formats;
+    formats.clear();
+    suffixes.clear();
     if (!detectFileName) {
         const QList<QByteArray> ba = QImageReader::supportedImageFormats();
         for (int i=0; i<ba.size(); ++i) {
             QString string = QString::fromLocal8Bit(ba.at(i));
             formats.insert(string);
             formats.insert(string.toUpper());
+            suffixes.insert(ba.at(i).toLower());
+            suffixes.insert(ba.at(i).toUpper());
         }
         formats.insert("pdf");
         formats.insert("PDF");
+        suffixes.insert("pdf");
+        suffixes.insert("PDF");
+    }
+
+    // Sibling directories are scanned concurrently, on network file systems
+    // the time goes to waiting for the server rather than to bandwidth.
+    const int count = recurse ? qMax(1, maxThreads) : 1;
+    for (int i=0; i<count; ++i) {
+        queues.append(new Queue);
+    }
+    addDirectory(0, QDir(directory).absolutePath());
+    QList<Walker*> walkers;
+    for (int i=1; i<count; ++i) {
+        Walker *walker = new Walker(this, i);
+        walkers.append(walker);
+        walker->start();
     }
+    walk(0);
+    foreach(Walker *walker, walkers) {
+        walker->wait();
+        delete walker;
+    }
+    qDeleteAll(queues);
+    queues.clear();
+}
+
+void FileNameThread::walk(int worker)
+{
+    // Files are handed over in batches, one queued signal per file floods
+    // the GUI thread's event loop on large trees
+    QList<FileEntry> batch;
+    QElapsedTimer timer;
+    timer.start();
+    QString dir;
+    while (!isAborted()) {
+        if (!takeDirectory(worker, &dir)) {
+            if (!outstanding.loadAcquire())
+                break;
+            QMutexLocker locker(&idleMutex);
+            idleCondition.wait(&idleMutex, 10);
+            continue;
+        }
+        scanDirectory(worker, dir, batch, timer);
+        if (outstanding.fetchAndAddOrdered(-1) == 1) {
+            QMutexLocker locker(&idleMutex);
+            idleCondition.wakeAll();
+        }
+    }
+    if (!batch.isEmpty())
+        emit files(batch);
+}
+
+// Takes the most recently found directory from our own queue, or the
+// oldest one from somebody else's.
+bool FileNameThread::takeDirectory(int worker, QString *dir)
+{
+    for (int i=0; i<queues.size(); ++i) {
+        const int idx = (worker + i) % queues.size();
+        Queue *queue = queues.at(idx);
+        QMutexLocker locker(&queue->mutex);
+        if (!queue->directories.isEmpty()) {
+            *dir = (idx == worker ? queue->directories.takeLast() : queue->directories.takeFirst());
+            return true;
+        }
+    }
+    return false;
+}
+
+void FileNameThread::addDirectory(int worker, const QString &dir)
+{
+    outstanding.ref();
+    Queue *queue = queues.at(worker);
+    {
+        QMutexLocker locker(&queue->mutex);
+        queue->directories.append(dir);
+    }
+    idleCondition.wakeOne();
+}
 
-    QDirIterator it(directory, QDir::NoDotAndDotDot|QDir::Files|QDir::Dirs,
-                    recurse ? QDirIterator::Subdirectories : QDirIterator::NoIteratorFlags);
+void FileNameThread::scanDirectory(int worker, const QString &dir, QList<FileEntry> &batch, QElapsedTimer &timer)
+{
+    enum { BatchSize = 1000, BatchInterval = 100 };
+#ifdef Q_OS_LINUX
+    // Reads the raw directory entries and goes by d_type, so most entries
+    // cost no stat at all and only matching files are turned into QStrings.
+    const int fd = ::open(QFile::encodeName(dir).constData(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd == -1)
+        return;
+    const QString prefix = dir.endsWith('/') ? dir : dir + '/';
+    const bool needSize = (minSize != -1 || maxSize != -1);
+    alignas(struct dirent64) char buffer[32 * 1024];
+    int index = 0;
+    bool stop = false;
+    while (!stop) {
+        const long bytes = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+        if (bytes <= 0)
+            break;
+        for (long pos = 0; pos < bytes; ) {
+            if (!batch.isEmpty() && (batch.size() >= BatchSize || timer.elapsed() >= BatchInterval)) {
+                emit files(batch);
+                batch.clear();
+                timer.restart();
+            }
+            if (++index % 10 == 0 && isAborted()) {
+                stop = true;
+                break;
+            }
+
+            const struct dirent64 *entry = reinterpret_cast<const struct dirent64*>(buffer + pos);
+            pos += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.') // hidden files, like QDir without QDir::Hidden, and . and ..
+                continue;
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN || type == DT_LNK) {
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW))
+                    continue;
+                if (S_ISLNK(st.st_mode)) {
+                    // links to files count, links to directories aren't followed
+                    if (fstatat(fd, name, &st, 0) || !S_ISREG(st.st_mode))
+                        continue;
+                    type = DT_REG;
+                } else if (S_ISDIR(st.st_mode)) {
+                    type = DT_DIR;
+                } else if (S_ISREG(st.st_mode)) {
+                    type = DT_REG;
+                } else {
+                    continue;
+                }
+            }
+
+            if (type == DT_DIR) {
+                if (recurse)
+                    addDirectory(worker, prefix + QFile::decodeName(name));
+                continue;
+            } else if (type != DT_REG) {
+                continue;
+            }
+            if (!detectFileName) {
+                const int length = strlen(name);
+                const char *dot = static_cast<const char*>(memrchr(name, '.', length));
+                if (!dot || !suffixes.contains(QByteArray::fromRawData(dot + 1, name + length - dot - 1)))
+                    continue;
+            }
+            FileEntry file;
+            if (needSize || statFiles) {
+                if (!::statFile(fd, name, &file) || !::matchSize(minSize, maxSize, file.size))
+                    continue;
+            }
+            file.path = prefix + QFile::decodeName(name);
+            if (matches(file.path)
+                && (!detectFileName || ::canLoad(fd, name, file.path))) {
+                batch.append(file);
+            }
+        }
+    }
+    ::close(fd);
+#else
+    QDirIterator it(dir, QDir::NoDotAndDotDot|QDir::Files|QDir::Dirs);
     int index = 0;
     while (it.hasNext()) {
         it.next();
         const QFileInfo fi = it.fileInfo();
-        if (::matchSize(minSize, maxSize, fi)) {
-            const QString absoluteFilePath = fi.absoluteFilePath();
-            if (detectFileName) {
-                if (matches(absoluteFilePath) && ImageLoaderThread::canLoad(absoluteFilePath)) {
-                    emit file(absoluteFilePath);
-                }
-            } else if (formats.contains(fi.suffix()) && matches(absoluteFilePath)) {
-                emit file(absoluteFilePath);
+        if (fi.isDir()) {
+            // like QDirIterator::Subdirectories, don't follow links to directories
+            if (recurse && !fi.isSymLink())
+                addDirectory(worker, fi.absoluteFilePath());
+        } else if (::matchSize(minSize, maxSize, fi)) {
+            FileEntry file(fi.absoluteFilePath());
+            if (detectFileName ? (matches(file.path) && ImageLoaderThread::canLoad(file.path))
+                : (formats.contains(fi.suffix()) && matches(file.path))) {
+                if (statFiles)
+                    file.read(fi);
+                batch.append(file);
             }
         }
+        if (!batch.isEmpty() && (batch.size() >= BatchSize || timer.elapsed() >= BatchInterval)) {
+            emit files(batch);
+            batch.clear();
+            timer.restart();
+        }
         if (++index % 10 == 0 && isAborted()) {
             break;
         }
     }
+#endif
 }
 
 bool FileNameThread::isAborted() const
@@ -241,14 +887,98 @@ void FileNameThread::abort()
     aborted = true;
 }
 
+// Captures size and dates for each file, for sorting by them
+void FileNameThread::setStatFiles(bool on)
+{
+    statFiles = on;
+}
+
 void FileNameThread::setSizeConstraints(int min, int max)
 {
     minSize = min;
     maxSize = max;
 }
 
-bool ImageLoaderThread::canLoad(const QString &fileName)
+void FileNameThread::setMaxThreads(int count)
+{
+    maxThreads = count;
+}
+
+// Checks the signatures of the formats we see the most, so that with
+// --detect-filetype not every image plugin has to probe every file.
+ImageLoaderThread::SniffResult ImageLoaderThread::sniff(const char *header, int size)
 {
+    static const struct {
+        const char *format;
+        const char *magic;
+        int length;
+        int offset; // of a second signature, e.g. WEBP inside a RIFF container
+        const char *magic2;
+        int length2;
+    } signatures[] = {
+        { "jpeg", "\xFF\xD8\xFF", 3, 0, 0, 0 },
+        { "png", "\x89PNG\r\n\x1A\n", 8, 0, 0, 0 },
+        { "gif", "GIF87a", 6, 0, 0, 0 },
+        { "gif", "GIF89a", 6, 0, 0, 0 },
+        { "webp", "RIFF", 4, 8, "WEBP", 4 },
+        { "tiff", "II*\0", 4, 0, 0, 0 },
+        { "tiff", "MM\0*", 4, 0, 0, 0 },
+        { "bmp", "BM", 2, 0, 0, 0 },
+        { "pdf", "%PDF", 4, 0, 0, 0 },
+        { 0, 0, 0, 0, 0, 0 }
+    };
+    static const QSet<QByteArray> supported = []() {
+        QSet<QByteArray> ret;
+        foreach(const QByteArray &format, QImageReader::supportedImageFormats()) {
+            ret.insert(format.toLower());
+        }
+        return ret;
+    }();
+
+    for (int i=0; signatures[i].format; ++i) {
+        if (size < signatures[i].length || memcmp(header, signatures[i].magic, signatures[i].length))
+            continue;
+        if (signatures[i].magic2
+            && (size < signatures[i].offset + signatures[i].length2
+                || memcmp(header + signatures[i].offset, signatures[i].magic2, signatures[i].length2))) {
+            continue;
+        }
+        const QByteArray format = signatures[i].format;
+        if (format == "bmp") {
+            // "BM" on its own is too weak, check the size of the DIB header too
+            if (size < 18)
+                continue;
+            const uchar dib = header[14];
+            if (dib != 12 && dib != 40 && dib != 52 && dib != 56 && dib != 64 && dib != 108 && dib != 124)
+                continue;
+        } else if (format == "pdf") {
+            return Loadable;
+        }
+        return supported.contains(format) ? Loadable : NotLoadable;
+    }
+    return Unrecognized;
+}
+
+bool ImageLoaderThread::canLoad(const QString &fileName, const char *header, int size)
+{
+    char buffer[32];
+    if (!header) {
+        QFile file(fileName);
+        if (file.open(QIODevice::ReadOnly|QIODevice::Unbuffered)) {
+            size = file.read(buffer, sizeof(buffer));
+            header = buffer;
+        }
+    }
+    if (header && size >= 0) {
+        switch (sniff(header, size)) {
+        case Loadable:
+            return true;
+        case NotLoadable:
+            return false;
+        case Unrecognized:
+            break;
+        }
+    }
     return (!QImageReader::imageFormat(fileName).isEmpty()
             || fileName.endsWith(".pdf", Qt::CaseInsensitive));
 }
@@ -256,5 +986,5 @@ bool ImageLoaderThread::canLoad(const QString &fileName)
 int ImageLoaderThread::pending() const
 {
     QMutexLocker lock(&mMutex);
-    return mPending;
+    return mQueue.size();
 }
@@ -3,72 +3,238 @@
 
 #include <QtGui>
 
-class ImageLoaderThread : public QThread
+class ImageLoaderThread : public QObject
 {
     Q_OBJECT
 public:
     ImageLoaderThread();
     ~ImageLoaderThread();
-    void run();
+    void start(int threadCount = QThread::idealThreadCount());
     void abort();
+    void wait();
     void clear();
 
     enum Flag {
         None = 0x0,
         NoSmoothScale = 0x1,
-        HighPriority = 0x2
+        HighPriority = 0x2,
+        CacheToDisk = 0x4,
+        Preview = 0x8 // emit imagePreview() first, if it's quick to make
     };
 
-    void load(QImageReader *reader, uint flags, int rotation, void *userData, const QSize &s = QSize());
-    bool remove(void *userData);
-    static bool canLoad(const QString &fileName);
+    // Requests are decoded in order of priority, lowest first. Among equal
+    // priorities HighPriority requests go ahead of everything else. id is
+    // the caller's and is handed back with the result. Readers that don't
+    // read from a file hand their device over along with themselves.
+    void load(QImageReader *reader, uint flags, int rotation, quint64 id,
+              const QSize &s = QSize(), int priority = 0);
+    // Drops the request for id, and the result of a decode of it that's
+    // already running. Returns whether it was still queued.
+    bool remove(quint64 id);
+    // flags are added to those of a request that's still queued, e.g.
+    // Preview for one that has become the current image
+    void reprioritize(quint64 id, int priority, int generation, uint flags = None);
+    void setGeneration(int generation);
+    enum SniffResult {
+        Unrecognized,
+        Loadable,
+        NotLoadable
+    };
+    static SniffResult sniff(const char *header, int size);
+    // header, if passed, holds the first bytes of the file, it is read otherwise
+    static bool canLoad(const QString &fileName, const char *header = 0, int size = -1);
+    // image in a format QPainter draws without converting it first
+    static QImage toDisplayFormat(const QImage &image);
     int pending() const;
 signals:
-    void imageLoaded(void *userData, const QImage &image);
-    void loadError(void *userData);
+    void imagePreview(quint64 id, const QImage &preview, const QSize &size);
+    void imageLoaded(quint64 id, const QImage &image);
+    void loadError(quint64 id);
 private:
+    void run();
+
+    class Worker : public QThread
+    {
+    public:
+        Worker(ImageLoaderThread *loader) : mLoader(loader) {}
+    protected:
+        void run() { mLoader->run(); }
+    private:
+        ImageLoaderThread *mLoader;
+    };
+
     friend class Window;
+    QList<Worker*> mWorkers;
     mutable QMutex mMutex;
     QWaitCondition mWaitCondition;
     struct Node {
-        ~Node() { delete reader; }
+        Node() : device(0), heapIndex(-1) {}
+        ~Node() { delete reader; delete device; }
         QImageReader *reader;
+        QIODevice *device;
         QSize size;
         int rotation;
         uint flags;
-        Node *next;
-        void *userData;
-    } *mFirst, *mLast;
+        QAtomicInt generation;
+        int priority;
+        qint64 sequence;
+        int heapIndex;
+        quint64 id;
+    };
+    bool isStale(const Node *node) const
+    {
+        return node->generation.loadAcquire() < mGeneration.loadAcquire();
+    }
+    static inline bool lessThan(const Node *left, const Node *right)
+    {
+        if (left->priority != right->priority)
+            return left->priority < right->priority;
+        return left->sequence < right->sequence;
+    }
+    void siftUp(int index);
+    void siftDown(int index);
+    void takeAt(int index);
+
+    QVector<Node*> mQueue; // binary heap
+    QHash<quint64, Node*> mQueued;
+    QList<Node*> mActive;
+    qint64 mSequence;
+    QAtomicInt mGeneration;
     volatile bool mAborted;
-    int mPending;
 };
 
-class ThumbLoaderThread : public QThread
+// Makes thumbnails on a small pool of its own. A request for an id and
+// width that's already on its way is folded into that one, unless it's for
+// the decoded image and what's on its way is the embedded preview.
+class ThumbLoader : public QObject
 {
     Q_OBJECT
 public:
-    ThumbLoaderThread(const QImage &image, int width);
-    void run();
+    ThumbLoader();
+    ~ThumbLoader();
+
+    // image is scaled to width if it's not null, otherwise the preview
+    // embedded in fileName is, turned by rotation degrees like the image
+    void request(quint64 id, int width, const QImage &image,
+                 const QString &fileName = QString(), int rotation = 0);
+    // results of cancelled requests are dropped, even if they're being made
+    void cancel(quint64 id, int width);
+    void clear();
+signals:
+    // thumb is null if there's no embedded preview
+    void thumbLoaded(quint64 id, int width, const QImage &thumb, bool embedded);
+private:
+    class Task;
+    typedef QPair<quint64, int> Key;
+    void finish(Task *task, const QImage &thumb);
+
+    QThreadPool mPool;
+    QMutex mMutex;
+    QHash<Key, Task*> mTasks;
+};
+
+// A tile of an image pyramid. Level n is the image at 1/2^n of its size,
+// column and row count TileLoader::TileSize pixels of that level.
+struct TileKey {
+    quint64 id;
+    int level, column, row;
+};
+Q_DECLARE_METATYPE(TileKey)
+
+inline bool operator==(const TileKey &left, const TileKey &right)
+{
+    return (left.id == right.id && left.level == right.level
+            && left.column == right.column && left.row == right.row);
+}
+
+inline uint qHash(const TileKey &key, uint seed = 0)
+{
+    return qHash(key.id, seed) ^ qHash((key.level << 28) ^ (key.column << 14) ^ key.row, seed);
+}
+
+// Decodes tiles on a pool of its own, each one with a clip rect and a
+// scaled size so only its part of the file is decoded. TIFFs, which Qt can't
+// clip, go through TiffRegion instead. For other handlers that can't clip,
+// the whole level is decoded once, one image at a time, and the tiles are
+// cut from it.
+class TileLoader : public QObject
+{
+    Q_OBJECT
+public:
+    enum { TileSize = 512 };
+    TileLoader();
+    ~TileLoader();
+
+    // size is the full size of the image in fileName. Requests for a tile
+    // that's already on its way are dropped.
+    void request(const TileKey &key, const QString &fileName, const QSize &size);
+    void clear();
+    // the part of the level that key covers
+    static QRect tileRect(const TileKey &key, const QSize &size);
 signals:
-    void thumbLoaded(const QImage &image);
+    // tile is null if it couldn't be decoded
+    void tileLoaded(const TileKey &key, const QImage &tile);
 private:
-    const QImage original;
-    const int width;
+    class Task;
+    void finish(Task *task, const QImage &tile);
+
+    QThreadPool mPool;
+    QMutex mMutex;
+    QHash<TileKey, Task*> mTasks;
+    QMutex mLevelMutex; // held while a whole level is decoded
+    QImage mLevel; // the last one, protected by mMutex
+    TileKey mLevelKey; // with column and row 0
 };
 
+// A file as found by FileNameThread. Times are ms since the epoch, created
+// falls back to the modification time where the birth time isn't known.
+// The metadata is -1 unless it was asked for.
+struct FileEntry {
+    FileEntry(const QString &p = QString()) : path(p), size(-1), created(-1), modified(-1) {}
+    void read(const QFileInfo &fi);
+
+    QString path;
+    qint64 size, created, modified;
+};
+Q_DECLARE_METATYPE(FileEntry)
+
 class FileNameThread : public QThread
 {
     Q_OBJECT
 public:
     FileNameThread(const QString &dir, /*int min, int max, */const QRegExp &rx, const QRegExp &irx, bool detectFileName, bool recurse);
     void setSizeConstraints(int min, int max);
+    void setMaxThreads(int count);
+    void setStatFiles(bool on);
     void run();
     bool isAborted() const;
     void abort();
 signals:
-    void file(const QString &file);
+    void files(const QList<FileEntry> &files);
 private:
     bool matches(const QString &filename) const;
+    void walk(int worker);
+    bool takeDirectory(int worker, QString *dir);
+    void addDirectory(int worker, const QString &dir);
+    void scanDirectory(int worker, const QString &dir, QList<FileEntry> &batch, QElapsedTimer &timer);
+
+    // Helper threads for recursive scans. Each walker scans directories off
+    // its own queue and steals from the others when that runs dry.
+    class Walker : public QThread
+    {
+    public:
+        Walker(FileNameThread *thread, int worker) : mThread(thread), mWorker(worker) {}
+    protected:
+        void run() { mThread->walk(mWorker); }
+    private:
+        FileNameThread *mThread;
+        const int mWorker;
+    };
+    struct Queue {
+        QMutex mutex;
+        QStringList directories;
+    };
+
     const QString directory;
     //const int minDepth;
     //const int maxDepth;
@@ -78,7 +244,14 @@ private:
     const bool detectFileName;
     const bool recurse;
     int minSize, maxSize;
+    int maxThreads;
+    bool statFiles;
+    QSet<QString> formats;
+    QSet<QByteArray> suffixes;
+    QVector<Queue*> queues;
+    QAtomicInt outstanding; // directories queued or being scanned
+    QMutex idleMutex;
+    QWaitCondition idleCondition;
 };
 
-
 #endif
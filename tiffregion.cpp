@@ -0,0 +1,128 @@
+#include "tiffregion.h"
+#ifdef TIFF_ENABLED
+#include <tiffio.h>
+
+namespace {
+enum { MaxChunkBytes = 64 * 1024 * 1024 };
+
+class File
+{
+public:
+    File(const QString &fileName)
+        : tif(0), width(0), height(0), chunkWidth(0), chunkHeight(0), tiled(false)
+    {
+        // TIFFOpen complains on stderr about anything that isn't a TIFF
+        QFile file(fileName);
+        if (!file.open(QIODevice::ReadOnly))
+            return;
+        const QByteArray magic = file.read(4);
+        if (magic != QByteArray("II*\0", 4) && magic != QByteArray("MM\0*", 4)
+            && magic != QByteArray("II+\0", 4) && magic != QByteArray("MM\0+", 4)) {
+            return;
+        }
+        file.close();
+        tif = TIFFOpen(QFile::encodeName(fileName).constData(), "r");
+        if (!tif || !TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width)
+            || !TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height)) {
+            return;
+        }
+        tiled = TIFFIsTiled(tif);
+        if (tiled) {
+            if (!TIFFGetField(tif, TIFFTAG_TILEWIDTH, &chunkWidth)
+                || !TIFFGetField(tif, TIFFTAG_TILELENGTH, &chunkHeight)) {
+                chunkWidth = chunkHeight = 0;
+            }
+        } else {
+            chunkWidth = width;
+            TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &chunkHeight);
+            chunkHeight = qMin(chunkHeight, height);
+        }
+    }
+    ~File()
+    {
+        if (tif)
+            TIFFClose(tif);
+    }
+
+    bool isValid() const
+    {
+        return (tif && width && height && chunkWidth && chunkHeight
+                && quint64(chunkWidth) * chunkHeight * 4 <= MaxChunkBytes);
+    }
+
+    TIFF *tif;
+    quint32 width, height, chunkWidth, chunkHeight;
+    bool tiled;
+};
+}
+
+bool TiffRegion::canRead(const QString &fileName)
+{
+    return File(fileName).isValid();
+}
+
+QImage TiffRegion::read(const QString &fileName, const QRect &rect, int scale)
+{
+    File file(fileName);
+    if (!file.isValid())
+        return QImage();
+    const QRect source = rect & QRect(0, 0, file.width, file.height);
+    if (source.isEmpty())
+        return QImage();
+    const QSize size((source.width() + scale - 1) / scale, (source.height() + scale - 1) / scale);
+    QVector<quint64> sums(size.width() * size.height() * 4, 0);
+    QVector<quint32> raster(file.chunkWidth * file.chunkHeight);
+    const int chunkWidth = file.chunkWidth, chunkHeight = file.chunkHeight;
+    for (int top = source.top() / chunkHeight * chunkHeight; top <= source.bottom(); top += chunkHeight) {
+        const int rows = qMin<int>(chunkHeight, file.height - top);
+        for (int left = source.left() / chunkWidth * chunkWidth; left <= source.right(); left += chunkWidth) {
+            const int ok = (file.tiled
+                            ? TIFFReadRGBATile(file.tif, left, top, raster.data())
+                            : TIFFReadRGBAStrip(file.tif, top, raster.data()));
+            if (!ok)
+                return QImage();
+            // the raster is bottom up, partial tiles are at the bottom of it
+            const int last = (file.tiled ? chunkHeight : rows) - 1;
+            const QRect part = QRect(left, top, chunkWidth, rows) & source;
+            for (int y = part.top(); y <= part.bottom(); ++y) {
+                const quint32 *line = raster.constData() + (last - (y - top)) * chunkWidth - left;
+                quint64 *sum = sums.data() + (y - source.top()) / scale * size.width() * 4;
+                for (int x = part.left(); x <= part.right(); ++x) {
+                    const quint32 pixel = line[x];
+                    quint64 *s = sum + (x - source.left()) / scale * 4;
+                    s[0] += TIFFGetR(pixel);
+                    s[1] += TIFFGetG(pixel);
+                    s[2] += TIFFGetB(pixel);
+                    s[3] += TIFFGetA(pixel);
+                }
+            }
+        }
+    }
+
+    // libtiff hands out premultiplied alpha, 255 for images without one
+    QImage image(size, QImage::Format_ARGB32_Premultiplied);
+    for (int y = 0; y < size.height(); ++y) {
+        const int rows = qMin(scale, source.height() - y * scale);
+        const quint64 *s = sums.constData() + y * size.width() * 4;
+        QRgb *line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < size.width(); ++x, s += 4) {
+            const quint64 count = quint64(rows) * qMin(scale, source.width() - x * scale);
+            line[x] = qRgba(s[0] / count, s[1] / count, s[2] / count, s[3] / count);
+        }
+    }
+    return image;
+}
+
+#else
+
+bool TiffRegion::canRead(const QString &)
+{
+    return false;
+}
+
+QImage TiffRegion::read(const QString &, const QRect &, int)
+{
+    return QImage();
+}
+
+#endif
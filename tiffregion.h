@@ -0,0 +1,20 @@
+#ifndef TIFFREGION_H
+#define TIFFREGION_H
+
+#include <QtGui>
+
+// Decodes part of a TIFF with libtiff, reading only the tiles or strips that
+// overlap it, which Qt's TIFF handler can't do. Built without libtiff
+// (TIFF_ENABLED unset) no file can be read.
+class TiffRegion
+{
+public:
+    // Whether fileName is a TIFF whose tiles or strips are small enough to
+    // be decoded one at a time
+    static bool canRead(const QString &fileName);
+    // rect is in pixels of the full size image, every scale x scale block of
+    // it is averaged into one pixel
+    static QImage read(const QString &fileName, const QRect &rect, int scale);
+};
+
+#endif
@@ -1,4 +1,7 @@
 #include "window.h"
+#include "diskcache.h"
+#include "exif.h"
+#include "tiffregion.h"
 #ifdef MAGICK_ENABLED
 #include <Magick++/Image.h>
 #include <Magick++/Geometry.h>
@@ -53,23 +56,48 @@ static inline QSet<int> surrounding(int cur, int count, int maxEntries)
     return ret;
 }
 
+// surrounding() keeps twice as many images ahead of the current one as behind
+// it, so an image behind is considered twice as far away as one ahead.
+static inline int distance(int index, int cur, int count)
+{
+    int ahead = index - cur;
+    if (ahead < 0)
+        ahead += count;
+    int behind = cur - index;
+    if (behind < 0)
+        behind += count;
+    return qMin(ahead, behind * 2);
+}
+
 Window::Window(const QStringList &args, QWidget *parent)
     : QAbstractScrollArea(parent), Flags(FirstImage|DisplayThumbnails)
 {
     d.current = -1;
     d.slideShowInterval = 3;
     d.maxImages = 30;
+    d.maxCacheBytes = -1;
+    d.cacheBytes = 0;
+    d.maxDiskCacheBytes = qint64(2048) * 1024 * 1024;
     d.penColor = Qt::yellow;
     d.thumbMinWidth = 50;
     d.fontSize = -1;
-    d.maxThreads = 3;
+    d.maxThreads = qMax(1, QThread::idealThreadCount());
     d.minSize = -1;
     d.maxSize = -1;
     d.midButtonPressed = false;
     d.quitTimerMinutes = 5;
     d.networkManager = 0;
     d.imagesInMemory = 0;
+    d.generation = 0;
+    d.infoTree = 0;
+    d.paintTime = 0;
+    d.scaledKey = 0;
+    d.zoom = 0;
+    d.tiles.setMaxCost(256 * 1024);
+    d.previewId = 0;
     d.sort = None;
+    qRegisterMetaType<QList<FileEntry> >("QList<FileEntry>");
+    qRegisterMetaType<TileKey>("TileKey");
 
     //    setViewport(new Viewport(this));
     d.lineEdit = new QLineEdit(this);
@@ -100,18 +128,29 @@ Window::Window(const QStringList &args, QWidget *parent)
             }
         }
     }
-    connect(&d.imageLoaderThread, SIGNAL(imageLoaded(void*, QImage)),
-            this, SLOT(onImageLoaded(void *, QImage)));
-    connect(&d.imageLoaderThread, SIGNAL(loadError(void*)),
-            this, SLOT(onImageLoadError(void *)));
-    d.imageLoaderThread.start();
+    if (test(UseDiskCache)) {
+        const qint64 max = d.maxDiskCacheBytes;
+        QThread *pruneThread = QThread::create([max]() { DiskCache::prune(max); });
+        connect(pruneThread, SIGNAL(finished()), pruneThread, SLOT(deleteLater()));
+        pruneThread->start(QThread::LowestPriority);
+    }
+    connect(&d.imageLoaderThread, SIGNAL(imageLoaded(quint64, QImage)),
+            this, SLOT(onImageLoaded(quint64, QImage)));
+    connect(&d.imageLoaderThread, SIGNAL(imagePreview(quint64, QImage, QSize)),
+            this, SLOT(onImagePreview(quint64, QImage, QSize)));
+    connect(&d.imageLoaderThread, SIGNAL(loadError(quint64)),
+            this, SLOT(onImageLoadError(quint64)));
+    connect(&d.thumbLoader, SIGNAL(thumbLoaded(quint64, int, QImage, bool)),
+            this, SLOT(onThumbLoaded(quint64, int, QImage, bool)));
+    connect(&d.tileLoader, SIGNAL(tileLoaded(TileKey, QImage)),
+            this, SLOT(onTileLoaded(TileKey, QImage)));
+    d.imageLoaderThread.start(d.maxThreads);
 }
 
 Window::~Window()
 {
     d.imageLoaderThread.abort();
     d.imageLoaderThread.wait();
-    qDeleteAll(d.data);
 }
 
 void Window::setBackgroundColor(const QString &string)
@@ -260,7 +299,7 @@ void Window::contextMenuEvent(QContextMenuEvent *e)
     }
     menu.addSeparator();
     QAction *copy = d.data.isEmpty() ? 0 : menu.addAction(tr("&Copy: '%1'").
-                                                          arg(d.data.at(d.current)->path));
+                                                          arg(d.catalog.path(d.data.at(d.current))));
     menu.addAction("About vp2", this, SLOT(about()));
     menu.addSeparator();
     const QAction *quit = menu.addAction(tr("&Quit"));
@@ -294,7 +333,7 @@ void Window::contextMenuEvent(QContextMenuEvent *e)
         showFullScreen();
     } else if (ret == copy) {
         QClipboard *clip = qApp->clipboard();
-        QString path = d.data.at(d.current)->path;
+        QString path = d.catalog.path(d.data.at(d.current));
         if (path.contains(' ')) {
             // ### check for "
             path.prepend('"');
@@ -355,6 +394,8 @@ enum Type {
     Recurse,
     MaxImageCount,
     MaxThreadCount,
+    MaxCacheSize,
+    DiskCacheSize,
     DashDash,
     //MaxDepth,
     //MinDepth,
@@ -420,7 +461,9 @@ void Window::parseArgs(const QStringList &argsIn)
         { "-Z", "--auto-zoom", ::AutoZoom, No, "Auto zoom" },
         { "-r", "--recurse", ::Recurse, No, "Recurse subdirectories" },
         { 0, "--max-images", ::MaxImageCount, One, "Limit number of images to keep in memory to argument" },
-        { 0, "--max-threads", ::MaxThreadCount, One, "Limit number of threads to run concurrently to argument" },
+        { 0, "--cache-mb", ::MaxCacheSize, One, "Limit memory used by decoded images to [arg] megabytes" },
+        { 0, "--disk-cache", ::DiskCacheSize, Optional, "Keep downscaled images in a disk cache (optional size in megabytes, default 2048)" },
+        { 0, "--max-threads", ::MaxThreadCount, One, "Number of threads decoding images or scanning directories concurrently (default: number of cores)" },
         { 0, "--max-size", ::MaxSize, One, "Don't load images that are larger than [arg] kb" },
         { 0, "--min-size", ::MinSize, One, "Only load images that are larger than or equal to [arg] kb" },
         { 0, "--ignore-failed", ::IgnoreFailed, No, "Ignore images that fail to load" },
@@ -692,6 +735,27 @@ void Window::parseArgs(const QStringList &argsIn)
                 }
                 break;
             }
+            case ::MaxCacheSize: {
+                bool ok;
+                const int mb = args.at(++i).toUInt(&ok);
+                if (!ok || mb < 1) {
+                    errorMessage = QString("%1's arg must be a positive integer").arg(arg);
+                } else {
+                    d.maxCacheBytes = qint64(mb) * 1024 * 1024;
+                }
+                break;
+            }
+            case ::DiskCacheSize:
+                set(UseDiskCache);
+                if (i + 1 < args.size()) {
+                    bool ok;
+                    const int mb = args.at(i + 1).toUInt(&ok);
+                    if (ok && mb > 0) {
+                        d.maxDiskCacheBytes = qint64(mb) * 1024 * 1024;
+                        ++i;
+                    }
+                }
+                break;
             case ::DashDash:
                 status |= SeenDashDash;
                 break;
@@ -765,25 +829,32 @@ void Window::parseArgs(const QStringList &argsIn)
         pictures.append(pic);
     }
 
+    // runs of files go in with one merge each rather than one per file
+    QStringList files;
     for (int i=0; i<pictures.size(); ++i) {
         const Pic &pic = pictures.at(i);
+        if (pic.type == Pic::File) {
+            files.append(pic.path);
+            continue;
+        }
+        if (!files.isEmpty()) {
+            addFiles(files);
+            files.clear();
+        }
         switch (pic.type) {
         case Pic::Dir:
             addDirectory(pic.path, status & RecurseDirs);
             break;
         case Pic::File:
-            addFile(pic.path);
             break;
         case Pic::Network:
-            if (!d.networkManager) {
-                d.networkManager = new QNetworkAccessManager(this);
-                connect(d.networkManager, SIGNAL(finished(QNetworkReply*)),
-                        this, SLOT(onNetworkReplyFinished(QNetworkReply*)));
-            }
-            d.networkManager->get(QNetworkRequest(pic.url));
+            // fetched when it comes within range, like files are loaded
+            addNode(d.catalog.add(FileEntry(pic.url.toString()), Catalog::Network));
             break;
         }
     }
+    if (!files.isEmpty())
+        addFiles(files);
     if (status & ShowFullScreen) {
         showFullScreen();
     } else {
@@ -797,7 +868,9 @@ void Window::addDirectory(const QString &path, bool recurse)
     FileNameThread *thread = new FileNameThread(path, d.regexp, d.ignoreRegexp,
                                                 test(DetectFileType), recurse);
     thread->setSizeConstraints(d.minSize, d.maxSize);
-    connect(thread, SIGNAL(file(QString)), this, SLOT(addFile(QString)));
+    thread->setMaxThreads(d.maxThreads);
+    thread->setStatFiles(statFiles());
+    connect(thread, SIGNAL(files(QList<FileEntry>)), this, SLOT(addFiles(QList<FileEntry>)));
     connect(thread, SIGNAL(finished()), this, SLOT(fileNameThreadFinished()));
     d.fileNameThreads.insert(thread);
     thread->start();
@@ -806,7 +879,20 @@ void Window::addDirectory(const QString &path, bool recurse)
 void Window::wheelEvent(QWheelEvent *e)
 {
     switch (e->modifiers()) {
+    case Qt::ControlModifier:
+        if (e->angleDelta().y() > 0) {
+            zoomIn();
+        } else if (e->angleDelta().y() < 0) {
+            zoomOut();
+        }
+        break;
     case Qt::NoModifier:
+        if (d.zoom) {
+            // pans
+            QAbstractScrollArea::wheelEvent(e);
+            break;
+        }
+        // fallthrough
     case Qt::ShiftModifier:
         if (e->angleDelta().y() < 0) {
             moveCurrentIndexBy(e->modifiers() & Qt::ShiftModifier ? 10 : 1);
@@ -823,9 +909,11 @@ void Window::wheelEvent(QWheelEvent *e)
 
 void Window::resizeEvent(QResizeEvent *e)
 {
-    if (!d.updateImagesTimer.isActive())
-        d.updateImagesTimer.start(10, this);
+    // decode again once the resize has settled, paint scales in the meantime
+    d.updateImagesTimer.start(200, this);
     d.updateFontSizeTimer.start(100, this);
+    if (d.zoom)
+        d.updateScrollBarsTimer.start(10, this);
     QRect r(0, 0, width(), d.lineEdit->sizeHint().height());
     r.moveBottom(height());
     d.lineEdit->setGeometry(r);
@@ -844,6 +932,8 @@ static inline void drawText(QPainter *p, const QRect &eventRect, const QRect &re
 
 void Window::paintEvent(QPaintEvent *e)
 {
+    QElapsedTimer timer;
+    timer.start();
     QPainter p(viewport());
     QFont f;
     if (d.fontSize > 0)
@@ -864,17 +954,38 @@ void Window::paintEvent(QPaintEvent *e)
         if (d.fileNameThreads.isEmpty())
             drawText(&p, eventRect, viewportRect, Qt::AlignCenter, fm, "No images specified");
     } else {
-        Data *dt = d.data.at(d.current);
-        if (d.toDelete.contains(dt))
+        const Catalog::Handle id = d.data.at(d.current);
+        const QString path = d.catalog.path(id);
+        QImage image = d.catalog.image(id);
+        QSize pixmapSize = image.size();
+        if (d.zoom) {
+            pixmapSize = zoomedSize();
+        } else if (image.isNull() && !d.preview.isNull() && d.previewId == id) {
+            // drawn at the size the real thing will have
+            image = d.preview;
+            pixmapSize = d.previewSize;
+        }
+        if (!d.zoom && !image.isNull() && test(AutoZoomEnabled)) {
+            pixmapSize.scale(viewport()->size(), Qt::KeepAspectRatio);
+            if (image.size() != pixmapSize) {
+                // scaled once for each size, not on every paint
+                if (d.scaled.size() != pixmapSize || d.scaledKey != image.cacheKey()) {
+                    d.scaled = image.scaled(pixmapSize, Qt::IgnoreAspectRatio,
+                                            test(NoSmoothScale) ? Qt::FastTransformation : Qt::SmoothTransformation);
+                    d.scaledKey = image.cacheKey();
+                }
+                image = d.scaled;
+            }
+        }
+        if (d.toDelete.contains(id))
             p.fillRect(viewportRect, QColor(255, 0, 0, 75));
-        if (dt->flags & Data::Failed) {
-            dt->flags |= Data::Seen;
-            drawText(&p, eventRect, viewportRect, Qt::AlignCenter, fm, "Can't load " + QFileInfo(dt->path).fileName());
+        if (d.catalog.flags(id) & Catalog::Failed) {
+            d.catalog.setFlags(id, d.catalog.flags(id) | Catalog::Seen);
+            drawText(&p, eventRect, viewportRect, Qt::AlignCenter, fm, "Can't load " + QFileInfo(path).fileName());
         } else {
-            if (dt->image.isNull()) {
-                drawText(&p, eventRect, viewportRect, Qt::AlignCenter, fm, "Loading " + QFileInfo(dt->path).fileName());
+            if (image.isNull() && !d.zoom) {
+                drawText(&p, eventRect, viewportRect, Qt::AlignCenter, fm, "Loading " + QFileInfo(path).fileName());
             } else {
-                const QSize pixmapSize = dt->image.size();
                 int x, y, sy, sx;
                 if (horizontalScrollBar()->isVisible()) {
                     sx = horizontalScrollBar()->value();
@@ -894,9 +1005,18 @@ void Window::paintEvent(QPaintEvent *e)
 
                 const QRect source(sx, sy, pixmapSize.width() - sx, pixmapSize.height() - sy);
                 const QRect r(QPoint(x, y), pixmapSize);
-                if (eventRect.isNull() || eventRect.intersects(r)) {
-                    p.drawImage(r, dt->image);
-                    p.drawRect(r);
+                const QRect scrolled = r.translated(-sx, -sy);
+                if (eventRect.isNull() || eventRect.intersects(QRect(r.topLeft(), source.size()))) {
+                    // only the part that's exposed, which is a thin strip when scrolling
+                    const QRect exposed = (eventRect.isNull() ? viewportRect : eventRect) & scrolled;
+                    if (d.zoom) {
+                        paintTiles(&p, scrolled, exposed, image);
+                    } else if (image.size() == pixmapSize) {
+                        p.drawImage(exposed, image, exposed.translated(-scrolled.topLeft()));
+                    } else {
+                        p.drawImage(scrolled, image);
+                    }
+                    p.drawRect(scrolled);
                 }
 
                 if (!d.rects.isEmpty()) {
@@ -927,7 +1047,7 @@ void Window::paintEvent(QPaintEvent *e)
 
                     for (QVector<QRect>::const_iterator it = d.rects.begin(); it != d.rects.end(); ++it) {
                         QRect rr = *it;
-                        rr.translate(r.topLeft());
+                        rr.translate(scrolled.topLeft());
                         QColor color = colors.at(idx++ % colors.size());
                         color.setAlpha(128);
 
@@ -944,19 +1064,28 @@ void Window::paintEvent(QPaintEvent *e)
                     // qDebug() << pixmapSize << thumbWidth << r;
                     ThumbInfo *thumbs[] = { &d.thumbLeft, &d.thumbRight };
                     for (int i=0; i<2; ++i) {
-                        const int idx = bound(d.current + (i == 0 ? -1 : 1));
-                        if (thumbWidth != thumbs[i]->image.width()
-                            && !d.data.at(idx)->image.isNull()
-                            && (!thumbs[i]->thread || thumbs[i]->requestedWidth != thumbWidth)) {
-                            thumbs[i]->thread = new ThumbLoaderThread(d.data.at(idx)->image, thumbWidth);
-                            d.thumbLoaderThreads.insert(thumbs[i]->thread);
-                            thumbs[i]->requestedWidth = thumbWidth;
-                            connect(thumbs[i]->thread, SIGNAL(finished()),
-                                    this, SLOT(onThumbThreadFinished()));
-                            connect(thumbs[i]->thread, SIGNAL(thumbLoaded(QImage)),
-                                    this, SLOT(onThumbLoaded(QImage)));
-                            thumbs[i]->thread->start();
+                        ThumbInfo *thumb = thumbs[i];
+                        const Catalog::Handle neighborId = d.data.at(bound(d.current + (i == 0 ? -1 : 1)));
+                        const QImage neighbor = d.catalog.image(neighborId);
+                        if (thumbWidth == thumb->image.width() && (!thumb->embedded || neighbor.isNull()))
+                            continue;
+                        if (thumb->requestedWidth == thumbWidth && thumb->id == neighborId
+                            && (!thumb->requestedEmbedded || neighbor.isNull())) {
+                            continue;
+                        }
+                        QString fileName;
+                        if (neighbor.isNull()) {
+                            if (thumb->noEmbedded || (d.catalog.flags(neighborId) & Catalog::Network))
+                                continue;
+                            // not decoded yet, go with the preview stored in the file
+                            fileName = d.catalog.path(neighborId);
                         }
+                        cancelThumb(thumb);
+                        thumb->id = neighborId;
+                        thumb->requestedWidth = thumbWidth;
+                        thumb->requestedEmbedded = neighbor.isNull();
+                        d.thumbLoader.request(neighborId, thumbWidth, neighbor, fileName,
+                                              d.catalog.rotation(neighborId));
                     }
                     if (!d.thumbLeft.image.isNull()) {
                         QRect rr = d.thumbLeft.image.rect();
@@ -975,11 +1104,14 @@ void Window::paintEvent(QPaintEvent *e)
             }
             if (test(DisplayFileName)) {
                 drawText(&p, eventRect, textArea(), Qt::AlignTop|Qt::AlignLeft, fm,
-                         dt->path + QString("\n%1 of %2 (%3 images in memory) (%4 in loading queue)").
+                         path + QString("\n%1 of %2 (%3 images in memory, %4 MB%5) (%6 in loading queue) (painted in %7 ms)").
                          arg(d.current + 1).
                          arg(d.data.size()).
                          arg(d.imagesInMemory).
-                         arg(d.imageLoaderThread.pending()));
+                         arg(d.cacheBytes / (1024.0 * 1024.0), 0, 'f', 1).
+                         arg(d.maxCacheBytes < 0 ? QString() : QString(" of %1").arg(d.maxCacheBytes / (1024 * 1024))).
+                         arg(d.imageLoaderThread.pending()).
+                         arg(d.paintTime / 1000000.0, 0, 'f', 2));
             }
         }
     }
@@ -987,74 +1119,108 @@ void Window::paintEvent(QPaintEvent *e)
         const QRect r(d.pressPosition, QCursor::pos());
         p.drawRect(r);
     }
+    d.paintTime = timer.nsecsElapsed();
+}
+
+// Autozoomed images are decoded to fit the viewport rounded up to steps of
+// 10%, paintEvent() scales them the rest of the way. Resizing only decodes
+// again once the viewport has left the step the image was decoded for.
+static inline int decodeBucket(int size)
+{
+    int bucket = 64;
+    while (bucket < size)
+        bucket = bucket * 11 / 10 + 1;
+    return bucket;
+}
+
+static inline QSize decodeSize(const QSize &viewportSize)
+{
+    return QSize(decodeBucket(viewportSize.width()), decodeBucket(viewportSize.height()));
 }
 
 bool Window::rightSize(const QSize &siz, const QSize &widgetSize) const
 {
     if (!test(AutoZoomEnabled) || siz == widgetSize)
         return true;
+    // anything from the size shown up to two steps above it will do
+    static const double MaxRatio = 1.1 * 1.1;
     QSize s = siz;
     s.scale(widgetSize, Qt::KeepAspectRatio);
-    return (s == siz);
+    return (siz.width() >= s.width() && siz.height() >= s.height()
+            && siz.width() <= s.width() * MaxRatio + 1 && siz.height() <= s.height() * MaxRatio + 1);
 }
 
 void Window::load(int index)
 {
     Q_ASSERT(index < d.data.size() && index >= 0);
-    Data *dt = d.data.at(index);
-    Q_ASSERT(dt);
-    if (dt->flags & Data::Failed || d.loading.contains(dt)) {
-        // qDebug() << "Not trying to load" << dt->path << "Because" << dt->flags << "but is it really?"
-        //          << d.loading.contains(dt);
+    const Catalog::Handle id = d.data.at(index);
+    if (d.catalog.flags(id) & Catalog::Failed || d.loading.contains(id) || d.catalog.movie(id)) {
+        // qDebug() << "Not trying to load" << d.catalog.path(id) << "Because" << d.catalog.flags(id)
+        //          << "but is it really?" << d.loading.contains(id);
         return;
     }
+    const QImage image = d.catalog.image(id);
 
     uint flags = 0;
     if (test(NoSmoothScale))
         flags |= ImageLoaderThread::NoSmoothScale;
     if (index == d.current || index == bound(d.current - 1) || index == bound(d.current + 1))
         flags |= ImageLoaderThread::HighPriority;
+    if (index == d.current && image.isNull())
+        flags |= ImageLoaderThread::Preview;
     QSize size;
     if (test(AutoZoomEnabled)) {
-        size = viewport()->size();
-        if (!dt->image.isNull()) {
-            if (!isVisible() || rightSize(dt->image.size(), size))
+        size = decodeSize(viewport()->size());
+        if (test(UseDiskCache))
+            flags |= ImageLoaderThread::CacheToDisk;
+        if (!image.isNull()) {
+            if (!isVisible() || rightSize(image.size(), viewport()->size()))
                 return;
         }
-    } else if (!dt->image.isNull()) {
+    } else if (!image.isNull()) {
+        return;
+    }
+    d.loading.insert(id);
+    const QString path = d.catalog.path(id);
+    if (d.catalog.flags(id) & Catalog::Network) {
+        const Fetch fetch = { id, flags, size, distance(index, d.current, d.data.size()) };
+        d.fetchQueue.append(fetch);
+        startFetches();
         return;
     }
-    d.loading[dt] = index;
 #if 0
-    if (dt->path.endsWith(".pdf", Qt::CaseInsensitive)) {
-        Magick::Image pdf(dt->path.toStdString());
+    if (path.endsWith(".pdf", Qt::CaseInsensitive)) {
+        Magick::Image pdf(path.toStdString());
         if (pdf.isValid()) {
             if (!size.isNull()) {
                 QSize s(pdf.columns(), pdf.rows());
                 s.scale(size, Qt::KeepAspectRatio);
                 pdf.resize(Magick::Geometry(s.width(), s.height()));
             }
-            if (dt->image.isNull())
-                ++d.imagesInMemory;
-
-            QImage image(pdf.columns(), pdf.rows(), QImage::Format_RGB32);
-            // pdf.write(0, 0, image.width(), image.height(), "RGB", Magick::IntegerPixel, image.bits());
-            pdf.write(0, 0, image.width(), image.height(), "RGB", Magick::CharPixel, image.bits());
-            onImageLoaded(dt, image);
+            QImage pdfImage(pdf.columns(), pdf.rows(), QImage::Format_RGB32);
+            // pdf.write(0, 0, pdfImage.width(), pdfImage.height(), "RGB", Magick::IntegerPixel, pdfImage.bits());
+            pdf.write(0, 0, pdfImage.width(), pdfImage.height(), "RGB", Magick::CharPixel, pdfImage.bits());
+            onImageLoaded(id, pdfImage);
         }
     } else
 #endif
     {
-        QImageReader *reader = new QImageReader(dt->path);
+        QImageReader *reader = new QImageReader(path);
         if (reader->supportsAnimation()) {
-            QMovie *movie = new QMovie(dt->path);
+            QMovie *movie = new QMovie(path);
             if (movie->isValid()) {
-                dt->movie = movie;
+                const QSize frameSize = reader->size();
+                const qint64 cost = qint64(frameSize.width()) * frameSize.height() * 4;
+                d.catalog.setMovie(id, movie, cost);
+                d.cacheBytes += cost;
+                ++d.imagesInMemory;
+                d.loading.remove(id);
                 delete reader;
                 return;
             }
         }
-        d.imageLoaderThread.load(reader, flags, dt->rotation, dt, size);
+        d.imageLoaderThread.load(reader, flags, d.catalog.rotation(id), id, size,
+                                 distance(index, d.current, d.data.size()));
     }
 }
 
@@ -1068,11 +1234,77 @@ void Window::updateImages()
     // start this first, it won't start again inside the loop
     if (test(FirstImage))
         return;
-    const QSet<int> sur = surrounding(d.current, d.data.size(), d.maxImages);
-    foreach(int i, sur) {
-        if (i != d.current) {
-            load(i);
-        }
+    foreach(int i, prefetchIndexes()) {
+        load(i);
+    }
+}
+
+// The indexes around the current one that should be in memory, nearest
+// first. With --cache-mb this stops where the images would no longer fit,
+// guessing the size of images that haven't been decoded yet from the ones
+// that have.
+QList<int> Window::prefetchIndexes() const
+{
+    QList<int> indexes = surrounding(d.current, d.data.size(), d.maxImages).values();
+    indexes.removeOne(d.current);
+    const int cur = d.current;
+    const int count = d.data.size();
+    std::sort(indexes.begin(), indexes.end(), [cur, count](int left, int right) {
+            return distance(left, cur, count) < distance(right, cur, count);
+        });
+    if (d.maxCacheBytes < 0)
+        return indexes;
+
+    const qint64 estimate = (d.imagesInMemory
+                             ? d.cacheBytes / d.imagesInMemory
+                             : qint64(viewport()->width()) * viewport()->height() * 4);
+    qint64 budget = d.maxCacheBytes - d.catalog.cost(d.data.at(d.current));
+    for (int i=0; i<indexes.size(); ++i) {
+        const qint64 cost = d.catalog.cost(d.data.at(indexes.at(i)));
+        budget -= (cost ? cost : estimate);
+        if (budget < 0)
+            return indexes.mid(0, i);
+    }
+    return indexes;
+}
+
+// Evicts the images furthest away from the current one until we're back
+// under --cache-mb.
+void Window::trimCache()
+{
+    if (d.maxCacheBytes < 0 || d.cacheBytes <= d.maxCacheBytes || d.data.isEmpty())
+        return;
+    QList<int> indexes = surrounding(d.current, d.data.size(), d.maxImages).values();
+    indexes.removeOne(d.current);
+    const int cur = d.current;
+    const int count = d.data.size();
+    std::sort(indexes.begin(), indexes.end(), [cur, count](int left, int right) {
+            return distance(left, cur, count) > distance(right, cur, count);
+        });
+    foreach(int i, indexes) {
+        if (d.cacheBytes <= d.maxCacheBytes)
+            break;
+        releaseImage(d.data.at(i));
+    }
+}
+
+void Window::setImage(Catalog::Handle id, const QImage &image)
+{
+    Q_ASSERT(!image.isNull());
+    // the loader has normally converted it already
+    const QImage display = ImageLoaderThread::toDisplayFormat(image);
+    if (!d.catalog.isResident(id))
+        ++d.imagesInMemory;
+    d.cacheBytes += display.sizeInBytes() - d.catalog.cost(id);
+    d.catalog.setImage(id, display, display.sizeInBytes());
+}
+
+void Window::releaseImage(Catalog::Handle id)
+{
+    const qint64 cost = d.catalog.cost(id);
+    if (d.catalog.release(id)) {
+        --d.imagesInMemory;
+        d.cacheBytes -= cost;
     }
 }
 
@@ -1119,7 +1351,7 @@ void Window::timerEvent(QTimerEvent *e)
         }
         if (d.fontSize != f.pixelSize()) {
             d.fontSize = f.pixelSize();
-            if (d.data.isEmpty() || d.data.at(d.current)->image.isNull()) {
+            if (d.data.isEmpty() || !d.catalog.isResident(d.data.at(d.current))) {
                 viewport()->update();
             } else {
                 viewport()->update(textArea());
@@ -1164,13 +1396,15 @@ void Window::fileNameThreadFinished()
     d.fileNameThreads.remove(thread);
     delete thread;
     if (d.fileNameThreads.isEmpty()) {
+        if (test(PendingSort))
+            sortData();
         updateImages();
     } else if (d.data.isEmpty() && test(DisplayFileName)) {
         viewport()->update(textArea());
     }
 #if 0
     for (int i=0; i<data.size(); ++i) {
-        qDebug() << i << QFileInfo(d.data.at(i)->path).fileName() << QFileInfo(d.data.at(i)->path).size();
+        qDebug() << i << QFileInfo(d.catalog.path(d.data.at(i))).fileName() << d.catalog.size(d.data.at(i));
     }
 #endif
 }
@@ -1189,205 +1423,357 @@ void Window::addImages()
     if (list.isEmpty())
         return;
     QSettings().setValue("dir", QFileInfo(list.at(0)).absolutePath());
-    foreach(const QString &file, list) {
-        addFile(file);
-    }
+    addFiles(list);
     updateImages();
 }
 void Window::clearImages()
 {
     d.imageLoaderThread.clear();
-    foreach(Data *dt, d.data) {
-        if (!(dt->flags & Data::Network))
-            dt->clear();
+    d.loading.clear();
+    d.fetchQueue.clear();
+    foreach(Catalog::Handle id, d.data) {
+        releaseImage(id);
     }
-    d.imagesInMemory = 0;
     updateImages();
 }
-typedef QList<Data*>::iterator DataIterator;
-static inline bool compareDataAlphabetically(const Data *left, const Data *right)
+static inline int compareBytes(const char *left, int leftLength, const char *right, int rightLength)
 {
-    return left->path < right->path;
+    const int ret = memcmp(left, right, qMin(leftLength, rightLength));
+    return ret ? ret : leftLength - rightLength;
 }
 
-static inline int toUInt(const QStringRef &ref)
+static inline bool compareAlphabetically(const Catalog &catalog, Catalog::Handle left, Catalog::Handle right)
 {
-    int number = 0;
-    for (int i=0; i<ref.size(); ++i) {
-        if (i > 0) {
-            number *= 10;
-        }
-        number += ref.at(i).toLatin1() - '0';
-        Q_ASSERT(ref.at(i).isNumber());
-    }
-    return number;
+    int leftLength, rightLength;
+    const char *l = catalog.pathData(left, &leftLength);
+    const char *r = catalog.pathData(right, &rightLength);
+    return compareBytes(l, leftLength, r, rightLength) < 0;
 }
 
-struct Section {
-    Section() : integer(-1) {}
-    Section(const QStringRef &r, bool number) : ref(r), integer(-1) {
-        if (number)
-            integer = ::toUInt(r);
-    }
-
-    int compare(const Section &other) const {
-        int ret = 0;
-        if (integer >= 0 && other.integer >= 0) {
-            if (integer < other.integer) {
-                ret = -1;
-            } else if (integer > other.integer) {
-                ret = 1;
-            }
-        } else {
-#if QT_VERSION >= 0x040500
-            ret = qBound(-1, ref.compare(other.ref), 1);
-#else
-            ret = ref < other.ref ? -1 : (ref > other.ref ? 1 : 0);
-#endif
+// Encodes a path so that natural ordering becomes a memcmp. Text is stored
+// as big endian UTF-16, each run of ASCII digits as 0x00 '0', the number of
+// digits without leading zeros as two bytes and then the digits themselves.
+// The marker sorts like a digit would against text and longer numbers sort
+// after shorter ones, however many digits they have.
+static QByteArray naturalKey(const QString &path)
+{
+    const ushort *data = path.utf16();
+    const int size = path.size();
+    QByteArray key(size * 2, Qt::Uninitialized);
+    char *out = key.data();
+    int pos = 0;
+    for (int i=0; i<size; ) {
+        if (data[i] < '0' || data[i] > '9') {
+            out[pos++] = data[i] >> 8;
+            out[pos++] = data[i] & 0xff;
+            ++i;
+            continue;
         }
-        return ret;
+        while (i + 1 < size && data[i] == '0' && data[i + 1] >= '0' && data[i + 1] <= '9')
+            ++i;
+        int end = i;
+        while (end < size && data[end] >= '0' && data[end] <= '9')
+            ++end;
+        const int digits = qMin(end - i, 0xffff);
+        if (pos + 4 + digits > key.size()) { // runs of fewer than four digits grow the key
+            key.resize(pos + 4 + digits + (size - end) * 2);
+            out = key.data();
+        }
+        out[pos++] = 0;
+        out[pos++] = '0';
+        out[pos++] = digits >> 8;
+        out[pos++] = digits & 0xff;
+        for (int j=0; j<digits; ++j) {
+            out[pos++] = data[i + j];
+        }
+        i = end;
     }
+    key.truncate(pos);
+    return key;
+}
 
-    QStringRef ref;
-    int integer;
-};
+static inline bool compareNaturally(const Catalog &catalog, Catalog::Handle left, Catalog::Handle right)
+{
+    int leftLength, rightLength;
+    const char *l = catalog.naturalKey(left, &leftLength);
+    const char *r = catalog.naturalKey(right, &rightLength);
+    return compareBytes(l, leftLength, r, rightLength) < 0;
+}
 
-static inline QList<Section> encode(const QString *string)
-{
-    static QHash<const QString*, QList<Section> > data;
-    QList<Section> ret;
-    if (!data.contains(string)) {
-        int last = 0;
-        enum { Unset, Number, NotNumber } state = Unset;
-        const int size = string->size();
-        for (int i=0; i<size; ++i) {
-            const bool number = string->at(i).isNumber();
-            if (state == Unset) {
-                state = (number ? Number : NotNumber);
-            } else if (number != (state == Number)) {
-                state = (number ? Number : NotNumber);
-                const QStringRef ref(string, last, i - last);
-                ret.append(Section(ref, !number));
-                last = i;
-            }
-        }
-        const QStringRef ref(string, last, size - last);
-        ret.append(Section(ref, state == Number));
-        data[string] = ret;
-    } else {
-        ret = data.value(string);
-    }
-    return ret;
 
+static inline bool compareBySize(const Catalog &catalog, Catalog::Handle left, Catalog::Handle right)
+{
+    return catalog.size(left) > catalog.size(right);
 }
 
-static inline bool compareDataNaturally(const Data *left, const Data *right)
+static inline bool compareByCreationDate(const Catalog &catalog, Catalog::Handle left, Catalog::Handle right)
 {
-    const QList<Section> l = encode(&left->path);
-    const QList<Section> r = encode(&right->path);
-    const int max = qMin(l.size(), r.size());
-    for (int i=0; i<max; ++i) {
-        switch (l.at(i).compare(r.at(i))) {
-        case -1:
-            return true;
-        case 0:
-            break;
-        case 1:
-            return false;
-        }
-    }
-    return l.size() < r.size();
+    return catalog.created(left) > catalog.created(right);
 }
 
 
-static inline bool compareDataBySize(const Data *left, const Data *right)
+void Window::addFile(const QString &path)
 {
-    static QHash<const Data*, qint64> size;
-#define FIND_SIZE(arg)                              \
-    qint64 &size_ ## arg = size[arg];               \
-    if (size_ ## arg == 0) {                        \
-        size_ ## arg = QFileInfo(arg->path).size(); \
-    }
-
-    FIND_SIZE(left);
-    FIND_SIZE(right);
-#undef FIND_SIZE
-    return size_left > size_right;
+    addFiles(QStringList(path));
 }
 
-static inline bool compareDataByCreationDate(const Data *left, const Data *right)
+void Window::addFiles(const QStringList &paths)
 {
-    static QHash<const Data*, uint> date;
-#define FIND_DATE(arg)                                              \
-    uint &date_ ## arg = date[arg];                                 \
-    if (date_ ## arg == 0) {                                        \
-        date_ ## arg = QFileInfo(arg->path).birthTime().toTime_t();   \
+    const bool stat = statFiles();
+    QList<FileEntry> files;
+    files.reserve(paths.size());
+    foreach(const QString &path, paths) {
+        FileEntry file(path);
+        if (stat)
+            file.read(QFileInfo(path));
+        files.append(file);
     }
+    addFiles(files);
+}
 
-    FIND_DATE(left);
-    FIND_DATE(right);
-#undef FIND_DATE
-    return date_left > date_right;
+void Window::addFiles(const QList<FileEntry> &files)
+{
+    QVector<Catalog::Handle> ids;
+    ids.reserve(files.size());
+    foreach(const FileEntry &file, files) {
+        ids.append(d.catalog.add(file));
+    }
+    addNodes(ids);
 }
 
+// Whether files need their size and dates for sorting
+bool Window::statFiles() const
+{
+    return d.sort == Size || d.sort == CreationDate;
+}
 
-void Window::addFile(const QString &path)
+void Window::addNode(Catalog::Handle id)
 {
-    Data *dt = new Data;
-    dt->path = path;
-    addNode(dt);
+    addNodes(QVector<Catalog::Handle>() << id);
 }
 
-void Window::addNode(Data *dt)
+// Merges a batch of nodes into d.data in one pass rather than inserting them
+// one at a time.
+void Window::addNodes(QVector<Catalog::Handle> nodes)
 {
-    if (test(DisplayFileName) && (d.data.size() + 1) % 10 == 0) {
+    if (nodes.isEmpty())
+        return;
+    if (test(DisplayFileName)) {
         viewport()->update(textArea());
     }
-    if (dt->path.size() > d.longestPath.size()) {
-        d.updateFontSizeTimer.start(1000, this);
-        d.longestPath = dt->path;
+    foreach(Catalog::Handle id, nodes) {
+        if (d.catalog.pathLength(id) > d.longestPath.size()) {
+            d.updateFontSizeTimer.start(1000, this);
+            d.longestPath = d.catalog.path(id);
+        }
     }
-    DataIterator it = d.data.end();
-    if (!d.data.isEmpty()) {
-        switch (d.sort) {
-        case Natural:
-            it = std::lower_bound<DataIterator>(d.data.begin(), d.data.end(), dt, compareDataNaturally);
-            break;
-        case Alphabetically:
-            it = std::lower_bound<DataIterator>(d.data.begin(), d.data.end(), dt, compareDataAlphabetically);
-            break;
-        case Size:
-            it = std::lower_bound<DataIterator>(d.data.begin(), d.data.end(), dt, compareDataBySize);
-            break;
-        case CreationDate:
-            it = std::lower_bound<DataIterator>(d.data.begin(), d.data.end(), dt, compareDataByCreationDate);
-            break;
-        case Random:
-            it = d.data.begin() + (rand() % d.data.size());
-            break;
-        case None:
-            break;
+
+    if (d.sort == Natural) {
+        foreach(Catalog::Handle id, nodes) {
+            if (!d.catalog.hasNaturalKey(id))
+                d.catalog.setNaturalKey(id, naturalKey(d.catalog.path(id)));
         }
     }
 
-    if (it == d.data.end()) {
-        d.data.append(dt);
+    const int oldSize = d.data.size();
+    if (d.sort == None || !d.fileNameThreads.isEmpty()) {
+        // While directories are being scanned files are shown in the order
+        // they're found and sorted once, when the scan is done.
+        d.data += nodes;
+        if (d.sort != None)
+            set(PendingSort);
     } else {
-        const int index = it - d.data.begin();
-        d.data.insert(it, dt);
-        modifyIndexes(index, 1);
-        if (d.current >= index && test(ManuallySetIndex))
-            ++d.current;
+        const LessThan lessThan = comparator(d.sort);
+        QVector<int> positions; // for Random, where in d.data each node goes
+        if (d.sort == Random) {
+            for (int i=nodes.size() - 1; i>0; --i) {
+                qSwap(nodes[i], nodes[rand() % (i + 1)]);
+            }
+            positions.resize(nodes.size());
+            for (int i=0; i<positions.size(); ++i) {
+                positions[i] = oldSize ? rand() % oldSize : 0;
+            }
+            std::sort(positions.begin(), positions.end());
+        } else {
+            const Catalog &catalog = d.catalog;
+            std::stable_sort(nodes.begin(), nodes.end(), [&catalog, lessThan](Catalog::Handle left, Catalog::Handle right) {
+                    return lessThan(catalog, left, right);
+                });
+        }
+
+        int newCurrent = d.current;
+        QVector<Catalog::Handle> merged;
+        merged.reserve(oldSize + nodes.size());
+        int o = 0, n = 0;
+        while (o < oldSize || n < nodes.size()) {
+            bool takeOld;
+            if (n == nodes.size()) {
+                takeOld = true;
+            } else if (o == oldSize) {
+                takeOld = false;
+            } else if (lessThan) {
+                // new nodes go in front of equal ones, like lower_bound would put them
+                takeOld = lessThan(d.catalog, d.data.at(o), nodes.at(n));
+            } else {
+                takeOld = o < positions.at(n);
+            }
+            if (takeOld) {
+                if (o == d.current)
+                    newCurrent = merged.size();
+                merged.append(d.data.at(o++));
+            } else {
+                merged.append(nodes.at(n++));
+            }
+        }
+        d.data = merged;
+        d.searchIndex.clear();
+        if (test(ManuallySetIndex))
+            d.current = newCurrent;
     }
-    if (d.data.size() == 1) {
+
+    if (!oldSize) {
         setCurrentIndex(0);
     }
 
-    if (d.data.size() <= d.maxImages) {
+    if (oldSize < d.maxImages) {
         updateImages();
     }
 }
 
+Window::LessThan Window::comparator(Sort sort)
+{
+    switch (sort) {
+    case Natural:
+        return compareNaturally;
+    case Alphabetically:
+        return compareAlphabetically;
+    case Size:
+        return compareBySize;
+    case CreationDate:
+        return compareByCreationDate;
+    case Random:
+    case None:
+        break;
+    }
+    return 0;
+}
+
+// Sorts [begin, end) in chunks on up to threadCount threads and merges the
+// chunks pairwise, also in parallel.
+template <typename T, typename Compare>
+static void parallelSort(T *begin, T *end, Compare lessThan, int threadCount)
+{
+    const qint64 count = end - begin;
+    enum { MinChunkSize = 16 * 1024 };
+    threadCount = qBound<qint64>(1, threadCount, count / MinChunkSize);
+    if (threadCount == 1) {
+        std::stable_sort(begin, end, lessThan);
+        return;
+    }
+
+    QVector<T*> bounds;
+    for (int i=0; i<=threadCount; ++i) {
+        bounds.append(begin + (count * i / threadCount));
+    }
+    QList<QThread*> threads;
+    for (int i=0; i+1<bounds.size(); ++i) {
+        T *first = bounds.at(i);
+        T *last = bounds.at(i + 1);
+        threads.append(QThread::create([first, last, lessThan]() { std::stable_sort(first, last, lessThan); }));
+    }
+    while (!threads.isEmpty()) {
+        foreach(QThread *thread, threads) {
+            thread->start();
+        }
+        foreach(QThread *thread, threads) {
+            thread->wait();
+        }
+        qDeleteAll(threads);
+        threads.clear();
+
+        if (bounds.size() <= 2)
+            break;
+        QVector<T*> next;
+        int i = 0;
+        for (; i+2<bounds.size(); i += 2) {
+            T *first = bounds.at(i);
+            T *middle = bounds.at(i + 1);
+            T *last = bounds.at(i + 2);
+            threads.append(QThread::create([first, middle, last, lessThan]() {
+                        std::inplace_merge(first, middle, last, lessThan);
+                    }));
+            next.append(first);
+        }
+        if (i + 1 < bounds.size())
+            next.append(bounds.at(i));
+        next.append(bounds.last());
+        bounds = next;
+    }
+}
+
+// Puts d.data in d.sort order in one go, the current image stays the same.
+void Window::sortData()
+{
+    unset(PendingSort);
+    const int count = d.data.size();
+    if (count < 2 || d.sort == None)
+        return;
+
+    QSet<int> before = surrounding(d.current, count, d.maxImages);
+    if (d.current != -1)
+        before.insert(d.current);
+
+    QVector<int> order(count);
+    for (int i=0; i<count; ++i) {
+        order[i] = i;
+    }
+    if (d.sort == Random) {
+        for (int i=count - 1; i>0; --i) {
+            qSwap(order[i], order[rand() % (i + 1)]);
+        }
+    } else {
+        const LessThan lessThan = comparator(d.sort);
+        const QVector<Catalog::Handle> &data = d.data;
+        const Catalog &catalog = d.catalog;
+        parallelSort(order.begin(), order.end(), [&data, &catalog, lessThan](int left, int right) {
+                return lessThan(catalog, data.at(left), data.at(right));
+            }, d.maxThreads);
+    }
+
+    QVector<Catalog::Handle> sorted;
+    sorted.reserve(count);
+    QVector<int> remap(count);
+    for (int i=0; i<count; ++i) {
+        sorted.append(d.data.at(order.at(i)));
+        remap[order.at(i)] = i;
+    }
+    d.data = sorted;
+    d.searchIndex.clear();
+    if (d.current != -1) {
+        // unless the user picked an image it's the first one that's shown,
+        // like addNodes() does it
+        const int current = test(ManuallySetIndex) ? remap.at(d.current) : 0;
+        if (current != remap.at(d.current))
+            resetZoom();
+        d.current = current;
+    }
+
+    // images that were around the current one but aren't anymore
+    QSet<int> after = surrounding(d.current, count, d.maxImages);
+    after.insert(d.current);
+    foreach(int i, before) {
+        const int index = remap.at(i);
+        if (!after.contains(index)) {
+            const Catalog::Handle id = d.data.at(index);
+            d.imageLoaderThread.remove(id);
+            d.loading.remove(id);
+            releaseImage(id);
+        }
+    }
+    dropFetches();
+    updateImages();
+}
+
 void Window::toggleSlideShow()
 {
     if (d.slideShowTimer.isActive()) {
@@ -1403,61 +1789,68 @@ void Window::toggleAutoZoom()
     updateImages();
 }
 
-void Window::onImageLoadError(void *userData)
+void Window::onImageLoadError(quint64 id)
 {
-    Data *dt = reinterpret_cast<Data*>(userData);
-    const int idx = d.loading.value(dt, -1);
-    d.loading.remove(dt);
-    if (idx == -1) {
+    if (!d.loading.remove(id))
         return;
-    }
-    printf("Failed to load %s\n", qPrintable(dt->path));
+    if (d.previewId == id)
+        d.preview = QImage();
+    printf("Failed to load %s\n", qPrintable(d.catalog.path(id)));
 
-    if (idx == d.current || test(DisplayFileName)) {
+    if (id == d.data.at(d.current) || test(DisplayFileName)) {
         viewport()->update();
     }
 
-    if (dt->clear())
-        --d.imagesInMemory;
+    releaseImage(id);
     if (test(FirstImage)) {
         unset(FirstImage);
         updateImages();
     }
     if (test(IgnoreFailed)) {
-        delete dt;
-        if (d.current > idx)
-            --d.current;
-        modifyIndexes(idx, -1);
+        const int index = d.data.indexOf(id);
+        if (index != -1 && removeEntry(index)) {
+            updateImages();
+            viewport()->update();
+        }
     } else {
-        dt->flags = Data::Failed;
+        d.catalog.setFlags(id, Catalog::Failed);
     }
 }
 
-void Window::onImageLoaded(void *userData, const QImage &image)
+void Window::onImagePreview(quint64 id, const QImage &preview, const QSize &size)
+{
+    if (!d.loading.contains(id) || d.current == -1 || id != d.data.at(d.current))
+        return;
+    d.preview = preview;
+    d.previewSize = size;
+    d.previewId = id;
+    viewport()->update();
+}
+
+void Window::onImageLoaded(quint64 id, const QImage &image)
 {
     static const bool verbose = (qgetenv("VP2_VERBOSE") == "1");
-    Data *dt = reinterpret_cast<Data*>(userData);
-    const int idx = d.loading.value(dt, -1);
-    d.loading.remove(dt);
+    const bool wanted = d.loading.remove(id);
     if (verbose) {
-        qDebug() << "got image" << idx << "current" << d.current << d.loading.values();
+        qDebug() << "got image" << id << (wanted ? "wanted" : "stale") << "current" << d.current << d.loading.size();
     }
 
-    if (idx == -1)
+    if (!wanted)
         return;
 
-    if (dt->image.isNull())
-        ++d.imagesInMemory;
-    dt->image = image;
+    if (d.previewId == id)
+        d.preview = QImage();
+    setImage(id, image);
+    trimCache();
 
-    if (idx == d.current) {
+    if (id == d.data.at(d.current)) {
         if (!rightSize(image.size(), viewport()->size())) {
             load(d.current);
         }
         d.updateScrollBarsTimer.start(10, this);
         updateAreas();
         viewport()->update();
-    } else if (idx == bound(d.current - 1) || idx == bound(d.current + 1)) {
+    } else if (id == d.data.at(bound(d.current - 1)) || id == d.data.at(bound(d.current + 1))) {
         updateAreas();
         updateThumbnails();
         viewport()->update();
@@ -1477,9 +1870,10 @@ void Window::debug()
     surr.insert(d.current);
 
     foreach(int j, surr) {
-        qDebug() << j << d.data.at(j)->path
-                 << (d.data.at(j)->image.isNull() ? "no image" : "has image")
-                 << "status" << d.data.at(j)->flags
+        const Catalog::Handle id = d.data.at(j);
+        qDebug() << j << d.catalog.path(id)
+                 << (d.catalog.isResident(id) ? "has image" : "no image")
+                 << "status" << d.catalog.flags(id)
                  << (j == d.current ? "<=" : "");
     }
 }
@@ -1564,9 +1958,9 @@ void Window::copyPath() const
     if (d.current != -1) {
         QClipboard *clip = qApp->clipboard();
         if (clip->supportsSelection()) {
-            clip->setText(d.data.at(d.current)->path, QClipboard::Selection);
+            clip->setText(d.catalog.path(d.data.at(d.current)), QClipboard::Selection);
         }
-        clip->setText(d.data.at(d.current)->path, QClipboard::Clipboard);
+        clip->setText(d.catalog.path(d.data.at(d.current)), QClipboard::Clipboard);
     }
 }
 
@@ -1580,9 +1974,8 @@ void Window::showInfo()
     for (int i=0; i<d.data.size(); ++i) {
         QTreeWidgetItem *it = new QTreeWidgetItem(tw);
         it->setData(0, Qt::DisplayRole, i);
-        it->setData(1, Qt::DisplayRole, d.data.at(i)->path);
-        if (!d.data.at(i)->image.isNull())
-            it->setData(2, Qt::DecorationRole, d.data.at(i)->image.scaled(40, 40));
+        it->setData(1, Qt::DisplayRole, d.catalog.path(d.data.at(i)));
+        it->setData(2, Qt::UserRole, d.data.at(i));
         if (i == d.current) {
             it->setSelected(true);
             tw->scrollToItem(it);
@@ -1593,7 +1986,36 @@ void Window::showInfo()
                                                  Qt::Horizontal, &dialog);
     l->addWidget(box);
     connect(box, SIGNAL(rejected()), &dialog, SLOT(accept()));
+    // thumbs are only made for the rows that get shown
+    d.infoTree = tw;
+    connect(tw->verticalScrollBar(), SIGNAL(valueChanged(int)), this, SLOT(updateInfoThumbnails()));
+    QTimer::singleShot(0, this, SLOT(updateInfoThumbnails()));
     dialog.exec();
+    d.infoTree = 0;
+}
+
+void Window::updateInfoThumbnails()
+{
+    if (!d.infoTree)
+        return;
+    QTreeWidget *tw = d.infoTree;
+    QTreeWidgetItem *it = tw->itemAt(0, 0);
+    const int bottom = tw->viewport()->height();
+    while (it && tw->visualItemRect(it).top() < bottom) {
+        const QVariant handle = it->data(2, Qt::UserRole);
+        if (handle.isValid()) {
+            const Catalog::Handle id = handle.value<Catalog::Handle>();
+            it->setData(2, Qt::UserRole, QVariant());
+            if (d.catalog.contains(id)) {
+                QImage image = d.catalog.image(id);
+                if (image.isNull() && !(d.catalog.flags(id) & Catalog::Network))
+                    image = Exif::thumbnail(d.catalog.path(id), d.catalog.rotation(id));
+                if (!image.isNull())
+                    it->setData(2, Qt::DecorationRole, image.scaled(40, 40, Qt::KeepAspectRatio));
+            }
+        }
+        it = tw->itemBelow(it);
+    }
 }
 
 void Window::toggleShowThumbnails()
@@ -1696,11 +2118,23 @@ void Window::keyPressEvent(QKeyEvent *e)
             toggleSlideShow();
         }
         break;
+    case Qt::Key_Equal:
+        if (e->modifiers() & Qt::ControlModifier)
+            zoomIn();
+        break;
     case Qt::Key_Plus:
+        if (e->modifiers() & Qt::ControlModifier) {
+            zoomIn();
+            break;
+        }
         d.slideShowInterval *= 0.9;
         d.slideShowTimer.start(int(d.slideShowInterval * 1000.0), this);
         break;
     case Qt::Key_Minus:
+        if (e->modifiers() & Qt::ControlModifier) {
+            zoomOut();
+            break;
+        }
         d.slideShowInterval *= 1.1;
         d.slideShowTimer.start(int(d.slideShowInterval * 1000.0), this);
         break;
@@ -1712,7 +2146,7 @@ void Window::keyPressEvent(QKeyEvent *e)
                 showFullScreen();
             }
         } else if (e->modifiers() == Qt::ShiftModifier && d.current != -1) {
-            printf("%s\n", qPrintable(d.data.at(d.current)->path));
+            printf("%s\n", qPrintable(d.catalog.path(d.data.at(d.current))));
         }
         break;
     case Qt::Key_N:
@@ -1790,6 +2224,10 @@ void Window::keyPressEvent(QKeyEvent *e)
     case Qt::Key_7:
     case Qt::Key_8:
     case Qt::Key_9: {
+        if (e->key() == Qt::Key_0 && e->modifiers() & Qt::ControlModifier) {
+            zoomNormal();
+            break;
+        }
         if (d.data.isEmpty() || e->text().isEmpty())
             return;
         d.indexBuffer.append(e->text());
@@ -1823,7 +2261,8 @@ void Window::setCurrentIndex(int index)
 {
     if (index == d.current)
         return;
-    d.history.prepend(index);
+    if (index >= 0 && index < d.data.size())
+        d.history.prepend(d.data.at(index));
     enum { Max = 1024 };
     while (d.history.size() > Max)
         d.history.takeLast();
@@ -1837,18 +2276,49 @@ void Window::setCurrentIndex(int index)
         QSet<int> surr = surrounding(index, d.data.size(), d.maxImages);
         QSet<int> remove = surrounding(d.current, d.data.size(), d.maxImages);
         if (d.current != index) {
+            resetZoom();
+            d.thumbLoader.clear();
             d.thumbLeft = d.thumbRight = ThumbInfo();
+            d.preview = QImage();
+            d.scaled = QImage();
         }
         d.current = index;
+        // Requests that are still wanted are re-ranked by their distance to
+        // the new index and move on to the new generation, everything else,
+        // including decodes already in progress, goes stale.
+        ++d.generation;
+        surr.insert(index);
+        QHash<Catalog::Handle, int> wanted; // to the new priority
+        foreach(int i, surr) {
+            const Catalog::Handle id = d.data.at(i);
+            if (d.loading.contains(id)) {
+                const int priority = distance(i, index, d.data.size());
+                // prefetched before it became current, so without a preview
+                const uint flags = ((i == index && !d.catalog.isResident(id))
+                                    ? ImageLoaderThread::Preview : ImageLoaderThread::None);
+                d.imageLoaderThread.reprioritize(id, priority, d.generation, flags);
+                wanted[id] = priority;
+            }
+        }
+        for (QSet<Catalog::Handle>::iterator it = d.loading.begin(); it != d.loading.end(); ) {
+            if (wanted.contains(*it)) {
+                ++it;
+            } else {
+                d.imageLoaderThread.remove(*it);
+                it = d.loading.erase(it);
+            }
+        }
+        d.imageLoaderThread.setGeneration(d.generation);
+        dropFetches();
+        for (QList<Fetch>::iterator it = d.fetchQueue.begin(); it != d.fetchQueue.end(); ++it) {
+            it->priority = wanted.value(it->id);
+        }
+        for (QHash<QNetworkReply*, Fetch>::iterator it = d.fetching.begin(); it != d.fetching.end(); ++it) {
+            it->priority = wanted.value(it->id, it->priority);
+        }
         foreach(int r, remove) {
-            if (r != index && !surr.contains(r)) {
-                Data *dt = d.data.at(r);
-                if (!(dt->flags & Data::Network)) {
-                    d.imageLoaderThread.remove(dt);
-                    d.loading.remove(dt);
-                    if (dt->clear())
-                        --d.imagesInMemory;
-                }
+            if (!surr.contains(r)) {
+                releaseImage(d.data.at(r));
             }
         }
 
@@ -1864,14 +2334,14 @@ void Window::nextDirectory(int count)
     Q_ASSERT(count != 0);
     const int add = (count < 0 ? -1 : 1);
     int max = qAbs(count);
-    const QString directory = QFileInfo(d.data.at(d.current)->path).absolutePath();
+    const QString directory = QFileInfo(d.catalog.path(d.data.at(d.current))).absolutePath();
     int i = d.current;
     while (max != 0) {
         i = bound(i + add);
         if (i == d.current && qAbs(count) == 1) {
             return; // only one dir here
         }
-        const QString dir = QFileInfo(d.data.at(i)->path).absolutePath();
+        const QString dir = QFileInfo(d.catalog.path(d.data.at(i))).absolutePath();
         if (dir != directory) {
             --max;
         }
@@ -1879,19 +2349,26 @@ void Window::nextDirectory(int count)
     setCurrentIndex(i);
 }
 
-void Window::onThumbLoaded(const QImage &thumb)
+void Window::onThumbLoaded(quint64 id, int width, const QImage &thumb, bool embedded)
 {
-    if (sender() == d.thumbLeft.thread) {
-        d.thumbLeft.image = thumb;
-        d.thumbLeft.thread = 0;
-        d.thumbLeft.requestedWidth = -1;
-    } else if (sender() == d.thumbRight.thread) {
-        d.thumbRight.image = thumb;
-        d.thumbRight.thread = 0;
-        d.thumbRight.requestedWidth = -1;
-    } else {
-        return;
+    // with two images both sides show the same one
+    ThumbInfo *thumbs[] = { &d.thumbLeft, &d.thumbRight };
+    bool changed = false;
+    for (int i=0; i<2; ++i) {
+        ThumbInfo *info = thumbs[i];
+        if (info->requestedWidth != width || info->id != id || info->requestedEmbedded != embedded)
+            continue;
+        info->requestedWidth = -1;
+        if (embedded && thumb.isNull()) {
+            info->noEmbedded = true;
+            continue;
+        }
+        info->image = thumb;
+        info->embedded = embedded;
+        changed = true;
     }
+    if (!changed)
+        return;
 
     updateAreas();
     viewport()->update(); // ### this is a bug. I have to do this or I get painting errors when rotating
@@ -1927,7 +2404,9 @@ void Window::updateAreas()
         return;
 
     const QRect r = viewport()->rect();
-    d.areas[Center] = d.data.at(d.current)->image.rect();
+    d.areas[Center] = d.catalog.image(d.data.at(d.current)).rect();
+    if (test(AutoZoomEnabled))
+        d.areas[Center].setSize(d.areas[Center].size().scaled(r.size(), Qt::KeepAspectRatio));
     d.areas[Center].moveCenter(r.center());
     const QRect left(0, 0, d.areas[Center].left(), r.height());
     const QRect right(d.areas[Center].right(), 0, left.width(), r.height());
@@ -1976,13 +2455,14 @@ void Window::updateAreas()
 #endif
 }
 
-void Window::onThumbThreadFinished()
+void Window::cancelThumb(ThumbInfo *thumb)
 {
-    ThumbLoaderThread *t = qobject_cast<ThumbLoaderThread*>(sender());
-    Q_ASSERT(t);
-    Q_ASSERT(d.thumbLoaderThreads.contains(t));
-    d.thumbLoaderThreads.remove(t);
-    delete t;
+    if (thumb->requestedWidth == -1)
+        return;
+    const ThumbInfo *other = (thumb == &d.thumbLeft ? &d.thumbRight : &d.thumbLeft);
+    if (other->requestedWidth != thumb->requestedWidth || other->id != thumb->id)
+        d.thumbLoader.cancel(thumb->id, thumb->requestedWidth);
+    thumb->requestedWidth = -1;
 }
 
 void Window::closeEvent(QCloseEvent *e)
@@ -2002,8 +2482,9 @@ bool Window::purge()
     if (d.toDelete.isEmpty())
         return true;
     QStringList list;
-    foreach(const Data *dt, d.toDelete) {
-        list.append(dt->path);
+    foreach(Catalog::Handle id, d.toDelete) {
+        if (d.catalog.contains(id))
+            list.append(d.catalog.path(id));
     }
     // ### todo, nicer dialog with thumbnails of images
 
@@ -2013,8 +2494,8 @@ bool Window::purge()
                                   : QString(),
                                   test(Closing) ? tr("Abort") : tr("No"))) {
     case 0:
-        foreach(Data *dt, d.toDelete) {
-            removeFile(dt);
+        foreach(Catalog::Handle id, d.toDelete) {
+            removeFile(id);
         }
         if (!test(Closing))
             d.toDelete.clear();
@@ -2029,40 +2510,70 @@ bool Window::purge()
     Q_ASSERT(0);
     return true;
 }
-void Window::removeFile(Data *dt)
+void Window::removeFile(Catalog::Handle id)
 {
-    QFile file(dt->path);
+    if (!d.catalog.contains(id))
+        return;
+    QFile file(d.catalog.path(id));
     const QString fn = QFileInfo(file).fileName();
     file.copy(backupDir().absolutePath() + "/" + fn);
     file.remove();
     if (!test(Closing)) {
-        const int index = d.data.indexOf(dt);
+        const int index = d.data.indexOf(id);
         if (index != -1) {
-            d.data.removeAt(index);
-            if (d.current >= index)
+            // the one before the current image is shown when that goes
+            if (d.current == index && d.current > 0)
                 --d.current;
-            if (d.data.isEmpty()) {
-                d.current = -1;
-            } else {
-                d.current = qBound(0, d.current, d.data.size() - 1);
-            }
-            delete dt;
+            removeEntry(index);
         }
         if (!d.updateImagesTimer.isActive())
             d.updateImagesTimer.start(0, this);
     }
 }
+
+// Removes d.data[index] from the list and the catalog, along with whatever
+// still refers to it. Returns whether it was the current image.
+bool Window::removeEntry(int index)
+{
+    const Catalog::Handle id = d.data.at(index);
+    const bool current = (index == d.current);
+    if (current)
+        resetZoom();
+    d.imageLoaderThread.remove(id);
+    d.loading.remove(id);
+    dropFetches();
+    releaseImage(id);
+    d.toDelete.remove(id);
+    d.history.removeAll(id);
+    if (d.previewId == id) {
+        d.preview = QImage();
+        d.previewId = 0;
+    }
+    if (d.thumbLeft.id == id || d.thumbRight.id == id) {
+        cancelThumb(&d.thumbLeft);
+        cancelThumb(&d.thumbRight);
+        d.thumbLeft = d.thumbRight = ThumbInfo();
+    }
+    d.data.removeAt(index);
+    d.searchIndex.clear();
+    if (d.current > index)
+        --d.current;
+    d.current = (d.data.isEmpty() ? -1 : qBound(0, d.current, d.data.size() - 1));
+    d.catalog.remove(id);
+    return current;
+}
+
 void Window::toggleRemoveCurrentImage()
 {
     if (d.data.isEmpty() || d.current == -1)
         return;
-    Data *dt = d.data.at(d.current);
-    if (dt->flags & Data::Network)
+    const Catalog::Handle id = d.data.at(d.current);
+    if (d.catalog.flags(id) & Catalog::Network)
         return;
-    if (d.toDelete.contains(dt)) {
-        d.toDelete.remove(dt);
+    if (d.toDelete.contains(id)) {
+        d.toDelete.remove(id);
     } else {
-        d.toDelete.insert(dt);
+        d.toDelete.insert(id);
     }
     viewport()->update();
 }
@@ -2071,9 +2582,9 @@ void Window::undeleteCurrentImage()
 {
     if (d.data.isEmpty() || d.current == -1)
         return;
-    Data *dt = d.data.at(d.current);
-    if (d.toDelete.contains(dt)) {
-        d.toDelete.remove(dt);
+    const Catalog::Handle id = d.data.at(d.current);
+    if (d.toDelete.contains(id)) {
+        d.toDelete.remove(id);
         viewport()->update();
     }
 }
@@ -2082,22 +2593,28 @@ void Window::removeCurrentImage()
 {
     if (d.data.isEmpty() || d.current == -1)
         return;
-    Data *dt = d.data.at(d.current);
-    if (dt->flags & Data::Network)
+    const Catalog::Handle id = d.data.at(d.current);
+    if (d.catalog.flags(id) & Catalog::Network)
         return;
 
-    if (!d.toDelete.contains(dt)) {
-        d.toDelete.insert(dt);
+    if (!d.toDelete.contains(id)) {
+        d.toDelete.insert(id);
         viewport()->update();
     }
 }
 void Window::updateScrollBars()
 {
     const QSize vs = viewport()->size();
-    const QSize s = d.current == -1 ? QSize() : d.data.at(d.current)->image.size();
+    QSize s;
+    if (d.zoom) {
+        s = zoomedSize();
+    } else if (d.current != -1) {
+        s = d.catalog.image(d.data.at(d.current)).size();
+    }
+    const bool scrollable = d.zoom || !test(AutoZoomEnabled);
     const int scrollBarSize = horizontalScrollBar()->sizeHint().height();
-    const bool needh = !test(AutoZoomEnabled) && s.height() > vs.height();
-    const bool needw = !test(AutoZoomEnabled) && s.width() > vs.width();
+    const bool needh = scrollable && s.height() > vs.height();
+    const bool needw = scrollable && s.width() > vs.width();
     const bool mightneedh = s.height() + scrollBarSize > vs.height();
     const bool mightneedw = s.width() + scrollBarSize > vs.width();
     if (needh || (needw && mightneedh)) {
@@ -2113,12 +2630,211 @@ void Window::updateScrollBars()
     }
 
 }
-void Window::scrollContentsBy(int /*dx*/, int /*dy*/)
+void Window::scrollContentsBy(int dx, int dy)
+{
+    if (d.midButtonPressed || d.current == -1) {
+        viewport()->update();
+        return;
+    }
+    const Catalog::Handle id = d.data.at(d.current);
+    const QImage image = d.catalog.image(id);
+    QSize size = image.size();
+    if (d.zoom) {
+        size = zoomedSize();
+    } else if (image.isNull() && d.previewId == id) {
+        size = d.previewSize;
+    }
+    const bool patterned = (viewport()->palette().brush(viewport()->backgroundRole()).style()
+                            != Qt::SolidPattern);
+    if (size.isEmpty() || (patterned && (image.isNull() || image.hasAlphaChannel()))) {
+        // a patterned background showing through wouldn't line up after
+        // being moved
+        viewport()->update();
+        return;
+    }
+    // Only the image moves, the background around it stays put. The image
+    // is placed like paintEvent() does it, centered along an axis that
+    // doesn't scroll.
+    const int x = (horizontalScrollBar()->isVisible() ? -horizontalScrollBar()->value()
+                   : (viewport()->width() - size.width()) / 2);
+    const int y = (verticalScrollBar()->isVisible() ? -verticalScrollBar()->value()
+                   : (viewport()->height() - size.height()) / 2);
+    // moves what's on screen and repaints the strips that scrolled into view
+    viewport()->scroll(dx, dy, QRect(QPoint(x, y), size) & viewport()->rect());
+    // the overlays stay put, they're painted again both where they belong
+    // and where they were moved to
+    QRegion overlays;
+    if (test(DisplayFileName))
+        overlays += textArea();
+    if (test(DisplayThumbnails)) {
+        const int height = viewport()->height();
+        overlays += QRect(0, 0, d.thumbLeft.image.width(), height);
+        overlays += QRect(viewport()->width() - d.thumbRight.image.width(), 0,
+                          d.thumbRight.image.width(), height);
+    }
+    if (!overlays.isEmpty())
+        viewport()->update(overlays + overlays.translated(dx, dy));
+}
+
+
+bool Window::prepareZoom()
+{
+    if (d.zoom)
+        return true;
+    if (d.current == -1)
+        return false;
+    const Catalog::Handle id = d.data.at(d.current);
+    // ### tiles are decoded the way they're stored, so no rotated images yet
+    if ((d.catalog.flags(id) & (Catalog::Network|Catalog::Failed)) || d.catalog.movie(id) || d.catalog.rotation(id))
+        return false;
+    QImageReader reader(d.catalog.path(id));
+    if (reader.transformation() != QImageIOHandler::TransformationNone)
+        return false;
+    d.zoomSize = reader.size();
+    if (d.zoomSize.isEmpty())
+        return false;
+    // Formats that can't be decoded a tile at a time are decoded whole for
+    // each level, which is only done for images that fit the budget
+    static const qint64 MaxUnclippedBytes = 512 * 1024 * 1024;
+    return (reader.supportsOption(QImageIOHandler::ClipRect)
+            || TiffRegion::canRead(d.catalog.path(id))
+            || qint64(d.zoomSize.width()) * d.zoomSize.height() * 4 <= MaxUnclippedBytes);
+}
+
+void Window::resetZoom()
+{
+    if (!d.zoom)
+        return;
+    d.zoom = 0;
+    d.tileLoader.clear();
+    d.tiles.clear();
+    updateScrollBars();
+    viewport()->update();
+}
+
+double Window::currentZoom() const
+{
+    Q_ASSERT(!d.zoomSize.isEmpty());
+    if (d.zoom)
+        return d.zoom;
+    QSize shown = d.catalog.image(d.data.at(d.current)).size();
+    if (shown.isEmpty()) {
+        shown = d.zoomSize.scaled(viewport()->size(), Qt::KeepAspectRatio);
+    } else if (test(AutoZoomEnabled)) {
+        // decoded a step larger than shown, see decodeSize()
+        shown.scale(viewport()->size(), Qt::KeepAspectRatio);
+    }
+    return double(shown.width()) / d.zoomSize.width();
+}
+
+int Window::zoomLevel() const
+{
+    // the smallest level that's still at least as large as what's shown
+    int level = 0;
+    while (level < 16 && d.zoom * (2 << level) <= 1.0)
+        ++level;
+    return level;
+}
+
+QSize Window::zoomedSize() const
 {
+    return QSize(qRound(d.zoomSize.width() * d.zoom), qRound(d.zoomSize.height() * d.zoom));
+}
+
+void Window::zoom(double ratio)
+{
+    enum { MaxZoom = 16 };
+    if (!prepareZoom())
+        return;
+    const QSize vs = viewport()->size();
+    const QSize fit = d.zoomSize.scaled(vs, Qt::KeepAspectRatio);
+    if (ratio <= double(fit.width()) / d.zoomSize.width()) {
+        resetZoom();
+        return;
+    }
+    ratio = qMin<double>(ratio, MaxZoom);
+
+    // keep what's in the middle of the viewport there
+    const double old = currentZoom();
+    const QSizeF content = QSizeF(d.zoomSize) * old;
+    const double cx = (content.width() <= vs.width()
+                       ? d.zoomSize.width() / 2.0
+                       : (horizontalScrollBar()->value() + vs.width() / 2.0) / old);
+    const double cy = (content.height() <= vs.height()
+                       ? d.zoomSize.height() / 2.0
+                       : (verticalScrollBar()->value() + vs.height() / 2.0) / old);
+
+    const int oldLevel = d.zoom ? zoomLevel() : -1;
+    d.zoom = ratio;
+    if (zoomLevel() != oldLevel)
+        d.tileLoader.clear(); // nobody wants the other level's tiles anymore
+    updateScrollBars();
+    horizontalScrollBar()->setValue(qRound(cx * ratio - vs.width() / 2.0));
+    verticalScrollBar()->setValue(qRound(cy * ratio - vs.height() / 2.0));
     viewport()->update();
-    //    viewport()->scroll(-dx, -dy);
 }
 
+void Window::zoomIn()
+{
+    if (prepareZoom())
+        zoom(currentZoom() * 1.25);
+}
+
+void Window::zoomOut()
+{
+    if (prepareZoom())
+        zoom(currentZoom() / 1.25);
+}
+
+void Window::paintTiles(QPainter *p, const QRect &target, const QRect &exposed, const QImage &backdrop)
+{
+    const Catalog::Handle id = d.data.at(d.current);
+    const int level = zoomLevel();
+    const double factor = d.zoom * (1 << level); // from the level to the viewport
+    const QRectF wanted(QPointF(exposed.topLeft() - target.topLeft()) / factor,
+                        QSizeF(exposed.size()) / factor);
+    const int firstColumn = int(wanted.left()) / TileLoader::TileSize;
+    const int lastColumn = int(wanted.right()) / TileLoader::TileSize;
+    const int firstRow = int(wanted.top()) / TileLoader::TileSize;
+    const int lastRow = int(wanted.bottom()) / TileLoader::TileSize;
+
+    QVector<TileKey> keys;
+    bool complete = true;
+    for (int row=firstRow; row<=lastRow; ++row) {
+        for (int column=firstColumn; column<=lastColumn; ++column) {
+            const TileKey key = { id, level, column, row };
+            if (TileLoader::tileRect(key, d.zoomSize).isEmpty())
+                continue;
+            keys.append(key);
+            if (!d.tiles.contains(key))
+                complete = false;
+        }
+    }
+    if (!complete && !backdrop.isNull()) {
+        // stretched until the tiles are in
+        p->drawImage(target, backdrop);
+    }
+    foreach(const TileKey &key, keys) {
+        if (const QImage *tile = d.tiles.object(key)) {
+            if (!tile->isNull()) {
+                const QRect rect = TileLoader::tileRect(key, d.zoomSize);
+                p->drawImage(QRectF(target.topLeft() + QPointF(rect.topLeft()) * factor,
+                                    QSizeF(rect.size()) * factor), *tile);
+            }
+        } else {
+            d.tileLoader.request(key, d.catalog.path(id), d.zoomSize);
+        }
+    }
+}
+
+void Window::onTileLoaded(const TileKey &key, const QImage &tile)
+{
+    if (!d.zoom || d.current == -1 || key.id != d.data.at(d.current) || key.level != zoomLevel())
+        return;
+    // null ones are kept too, so they aren't asked for again
+    d.tiles.insert(key, new QImage(tile), qMax(1, int(tile.sizeInBytes() / 1024)));
+    viewport()->update();
+}
 
 void Window::restartQuitTimer()
 {
@@ -2127,25 +2843,25 @@ void Window::restartQuitTimer()
     }
 }
 
-int Window::indexOf(const QString &string, int index) const
+// The index covers d.data from the front, whatever has been appended since
+// the last search is added here.
+void Window::updateSearchIndex() const
 {
-    const int max = d.data.size();
-    while (index < max) {
-        if (d.data.at(index)->path.contains(string, Qt::CaseInsensitive))
-            return index;
-        ++index;
+    for (int i=d.searchIndex.size(); i<d.data.size(); ++i) {
+        d.searchIndex.append(d.catalog.path(d.data.at(i)));
     }
-    return -1;
+}
+
+int Window::indexOf(const QString &string, int index) const
+{
+    updateSearchIndex();
+    return d.searchIndex.indexOf(string, index);
 }
 
 int Window::lastIndexOf(const QString &string, int index) const
 {
-    while (index >= 0) {
-        if (d.data.at(index)->path.contains(string, Qt::CaseInsensitive))
-            return index;
-        --index;
-    }
-    return -1;
+    updateSearchIndex();
+    return d.searchIndex.lastIndexOf(string, index);
 }
 
 bool Window::searchNext()
@@ -2227,8 +2943,9 @@ void Window::about()
         string += ba + "\n";
     }
 
-    if (d.current != -1 && !d.data.at(d.current)->image.isNull()) {
-        string += QString("%1 x %2\n").arg(d.data.at(d.current)->image.width()).arg(d.data.at(d.current)->image.height());
+    const QImage image = d.current == -1 ? QImage() : d.catalog.image(d.data.at(d.current));
+    if (!image.isNull()) {
+        string += QString("%1 x %2\n").arg(image.width()).arg(image.height());
     }
 
     QLabel *lbl = new QLabel(string, &dlg);
@@ -2278,7 +2995,9 @@ void Window::back()
         //        qDebug() << d.history;
         d.history.append(d.history.takeFirst());
         set(InNextPrev);
-        setCurrentIndex(d.history.first());
+        const int index = d.data.indexOf(d.history.first());
+        if (index != -1)
+            setCurrentIndex(index);
         d.history.takeFirst();
         unset(InNextPrev);
     }
@@ -2290,104 +3009,124 @@ void Window::forward()
         //        qDebug() << d.history;
         d.history.prepend(d.history.takeLast());
         set(InNextPrev);
-        setCurrentIndex(d.history.first());
+        const int index = d.data.indexOf(d.history.first());
+        if (index != -1)
+            setCurrentIndex(index);
         d.history.takeFirst();
         unset(InNextPrev);
     }
 }
 
-void Window::onNetworkReplyFinished(QNetworkReply *reply)
+// Downloads at most MaxFetches remote images at a time, nearest first. The
+// HTTP cache keeps them around on disk so that coming back to an image that
+// was released doesn't go to the network again.
+void Window::startFetches()
 {
-    Data *node = new Data;
-    node->flags = Data::Network;
-
-    const QByteArray data = reply->readAll();
-    if (!data.isEmpty()) {
-        QBuffer buffer;
-        buffer.setData(data);
-        QImageReader reader(&buffer);
-        if (test(AutoZoomEnabled)) {
-            QSize s = reader.size();
-            if (s != viewport()->size()) {
-                s.scale(viewport()->size(), Qt::KeepAspectRatio);
-                reader.setScaledSize(s);
-            }
-        }
-        node->image = reader.read();
+    enum { MaxFetches = 4 };
+    if (!d.networkManager) {
+        d.networkManager = new QNetworkAccessManager(this);
+        QNetworkDiskCache *cache = new QNetworkDiskCache(d.networkManager);
+        cache->setCacheDirectory(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/network");
+        d.networkManager->setCache(cache);
+        connect(d.networkManager, SIGNAL(finished(QNetworkReply*)),
+                this, SLOT(onNetworkReplyFinished(QNetworkReply*)));
     }
-    node->path = reply->url().toString();
-    if (node->image.isNull()) {
-        node->flags |= Data::Failed;
-    } else {
-        ++d.imagesInMemory;
+    std::stable_sort(d.fetchQueue.begin(), d.fetchQueue.end(), [](const Fetch &left, const Fetch &right) {
+            return left.priority < right.priority;
+        });
+    while (d.fetching.size() < MaxFetches && !d.fetchQueue.isEmpty()) {
+        const Fetch fetch = d.fetchQueue.takeFirst();
+        QNetworkRequest request(QUrl(d.catalog.path(fetch.id)));
+        request.setAttribute(QNetworkRequest::CacheLoadControlAttribute, QNetworkRequest::PreferCache);
+        d.fetching[d.networkManager->get(request)] = fetch;
     }
-    addNode(node);
+}
+
+// Queued downloads that nobody is waiting for anymore. The ones in flight
+// are left to finish, they end up in the cache.
+void Window::dropFetches()
+{
+    for (QList<Fetch>::iterator it = d.fetchQueue.begin(); it != d.fetchQueue.end(); ) {
+        if (d.loading.contains(it->id)) {
+            ++it;
+        } else {
+            it = d.fetchQueue.erase(it);
+        }
+    }
+}
+
+// The downloaded bytes are decoded by ImageLoaderThread, like any file
+void Window::onNetworkReplyFinished(QNetworkReply *reply)
+{
     reply->deleteLater();
+    const Fetch fetch = d.fetching.take(reply);
+    startFetches();
+    if (!d.loading.contains(fetch.id))
+        return;
+    if (reply->error() != QNetworkReply::NoError) {
+        onImageLoadError(fetch.id);
+        return;
+    }
+    QBuffer *buffer = new QBuffer;
+    buffer->setData(reply->readAll());
+    buffer->open(QIODevice::ReadOnly);
+    d.imageLoaderThread.load(new QImageReader(buffer), fetch.flags, d.catalog.rotation(fetch.id),
+                             fetch.id, fetch.size, fetch.priority);
 }
 
 void Window::shuffle()
 {
     if (d.data.isEmpty())
         return;
-    Data *current = d.data.at(d.current);
-    d.current = -1;
-    d.loading.clear();
-    d.history.clear();
-    auto prev = std::move(d.data);
     d.sort = Random;
-    for (Data *dt : prev) {
-        addNode(dt);
-    }
-    d.current = d.data.indexOf(current);
+    sortData();
     viewport()->update();
 }
 
-void Window::rotateLeft()
+void Window::rotate(int degrees)
 {
-    if (d.current != -1) {
-        Data *data = d.data.at(d.current);
-        if (data->rotation == 0) {
-            data->rotation = 270;
-        } else {
-            data->rotation -= 90;
-        }
-        if (!data->image.isNull()) {
-            QTransform transform;
-            transform.rotate(-90);
-            data->image = data->image.transformed(transform);
-            updateAreas();
-            viewport()->update();
-        }
-    }
+    if (d.current == -1)
+        return;
+    resetZoom();
+    const Catalog::Handle id = d.data.at(d.current);
+    d.catalog.setRotation(id, (d.catalog.rotation(id) + degrees) % 360);
+
+    // The loader decodes it again, turned. A quarter size copy of what's
+    // shown now stands in until then.
+    QImage image = d.catalog.image(id);
+    QSize size = image.size();
+    if (image.isNull() && d.previewId == id) {
+        image = d.preview;
+        size = d.previewSize;
+    }
+    if (!image.isNull()) {
+        QTransform transform;
+        transform.rotate(degrees);
+        d.preview = image.scaled(qMax(1, image.width() / 4), qMax(1, image.height() / 4),
+                                 Qt::IgnoreAspectRatio, Qt::FastTransformation).transformed(transform);
+        d.previewSize = size.transposed();
+        d.previewId = id;
+    }
+    // a download on its way is decoded with the new rotation anyway
+    bool downloading = false;
+    foreach(const Fetch &fetch, d.fetchQueue + d.fetching.values())
+        downloading = downloading || fetch.id == id;
+    if (!downloading) {
+        d.imageLoaderThread.remove(id);
+        d.loading.remove(id);
+    }
+    releaseImage(id);
+    load(d.current);
+    updateAreas();
+    viewport()->update();
 }
 
-void Window::rotateRight()
+void Window::rotateLeft()
 {
-    if (d.current != -1) {
-        Data *data = d.data.at(d.current);
-        if (data->rotation == 270) {
-            data->rotation = 0;
-        } else {
-            data->rotation += 90;
-        }
-        if (!data->image.isNull()) {
-            QTransform transform;
-            transform.rotate(90);
-            data->image = data->image.transformed(transform);
-            updateAreas();
-            viewport()->update();
-        }
-    }
+    rotate(270);
 }
-void Window::modifyIndexes(int index, int added)
+
+void Window::rotateRight()
 {
-    for (QHash<Data*, int>::iterator it = d.loading.begin(); it != d.loading.end(); ++it) {
-        if (it.value() >= index) {
-            it.value() += added;
-        }
-    }
-    for (auto i = d.history.begin(); i != d.history.end(); ++i) {
-        if (*i >= index)
-            (*i) += added;
-    }
+    rotate(90);
 }
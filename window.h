@@ -6,37 +6,9 @@
 #include <QtWidgets>
 #endif
 #include "threads.h"
+#include "catalog.h"
 #include "flags.h"
-
-struct Data {
-    Data() : movie(0), rotation(0), flags(0) {}
-
-    QString path;
-    QImage image;
-    QMovie *movie;
-    int rotation;
-
-    bool clear() {
-        if (!image.isNull()) {
-            image = QImage();
-            return true;
-        }
-        if (movie) {
-            delete movie;
-            movie = 0;
-            return true;
-        }
-        return false;
-    }
-
-    enum Flag {
-        None = 0x0,
-        Failed = 0x1,
-        Seen = 0x2,
-        Network = 0x4
-    };
-    uint flags;
-};
+#include "searchindex.h"
 
 class Window : public QAbstractScrollArea, private Flags
 {
@@ -61,17 +33,20 @@ protected:
     virtual void scrollContentsBy(int dx, int dy);
     int indexOf(const QString &string, int index) const;
     int lastIndexOf(const QString &string, int index) const;
+    void updateSearchIndex() const;
     void updateThumbnails() {
         viewport()->update(d.areas[ThumbLeft]);
         viewport()->update(d.areas[ThumbRight]);
     }
     void updateAreas();
     QRect textArea() const;
-    //    void zoom(double ratio);
+    // ratio is relative to the full size of the image, zooming out as far
+    // as fitting the viewport goes back to showing the decoded image
+    void zoom(double ratio);
 public slots:
-    //     void zoomNormal() { zoom(1); }
-    //     void zoomIn();
-    //     void zoomOut();
+    void zoomNormal() { zoom(1); }
+    void zoomIn();
+    void zoomOut();
     void shuffle();
     void rotateLeft();
     void rotateRight();
@@ -91,6 +66,7 @@ public slots:
     void startRect();
     void toggleCursorVisible();
     void showInfo();
+    void updateInfoThumbnails();
     void copyPath() const;
     bool searchPrevious();
     void onLineEditReturnPressed();
@@ -103,14 +79,18 @@ public slots:
     void addImages();
     void clearImages();
     void addFile(const QString &path);
-    void addNode(Data *node);
+    void addFiles(const QStringList &paths);
+    void addFiles(const QList<FileEntry> &files);
+    void addNode(Catalog::Handle id);
+    void addNodes(QVector<Catalog::Handle> nodes);
     void toggleSlideShow();
     void toggleAutoZoom();
-    void onImageLoadError(void *);
-    void onImageLoaded(void *, const QImage &image);
-    void onThumbLoaded(const QImage &thumb);
+    void onImageLoadError(quint64 id);
+    void onImagePreview(quint64 id, const QImage &preview, const QSize &size);
+    void onImageLoaded(quint64 id, const QImage &image);
+    void onThumbLoaded(quint64 id, int width, const QImage &thumb, bool embedded);
+    void onTileLoaded(const TileKey &key, const QImage &tile);
     void debug();
-    void onThumbThreadFinished();
 
     bool purge();
     void resetLineEditStyleSheet();
@@ -118,7 +98,6 @@ public slots:
     void forward();
     void onNetworkReplyFinished(QNetworkReply *reply);
 private:
-    void modifyIndexes(int index, int added);
     void restartQuitTimer();
     void updateScrollBars();
     void nextDirectory(int count);
@@ -130,30 +109,65 @@ private:
     void setCurrentIndex(int index);
     inline int bound(int cnt) const;
     void moveCurrentIndexBy(int count);
-    void removeFile(Data *data);
+    void rotate(int degrees);
+    void removeFile(Catalog::Handle id);
+    bool removeEntry(int index);
+    void sortData();
+    bool statFiles() const;
+    void setImage(Catalog::Handle id, const QImage &image);
+    void releaseImage(Catalog::Handle id);
+    QList<int> prefetchIndexes() const;
+    void trimCache();
+    void startFetches();
+    void dropFetches();
+    bool prepareZoom();
+    void resetZoom();
+    double currentZoom() const;
+    int zoomLevel() const;
+    QSize zoomedSize() const;
+    void paintTiles(QPainter *p, const QRect &target, const QRect &exposed, const QImage &backdrop);
 
     enum Sort { None, Alphabetically, Size, CreationDate, Random, Natural };
+    typedef bool (*LessThan)(const Catalog &catalog, Catalog::Handle left, Catalog::Handle right);
+    static LessThan comparator(Sort sort);
     enum Area { Top, Bottom, TopLeft, ThumbLeft, BottomLeft, Center,
                 TopRight, ThumbRight, BottomRight, NumAreas };
 
+    struct Fetch {
+        Catalog::Handle id;
+        uint flags;
+        QSize size;
+        int priority;
+    };
+
     struct ThumbInfo {
-        ThumbInfo() : thread(0), requestedWidth(-1) {}
+        ThumbInfo()
+            : id(0), requestedWidth(-1), requestedEmbedded(false), embedded(false), noEmbedded(false)
+        {}
         QImage image;
-        ThumbLoaderThread *thread;
-        int requestedWidth;
+        Catalog::Handle id; // what was last requested
+        int requestedWidth; // -1 unless a request is on its way
+        bool requestedEmbedded;
+        bool embedded; // image is the file's EXIF preview, until the neighbor is decoded
+        bool noEmbedded; // the file doesn't have one
     };
 
+    void cancelThumb(ThumbInfo *thumb);
+
     struct {
-        QHash<Data*, int> loading;
+        QSet<Catalog::Handle> loading;
 
-        QList<Data*> data;
-        QSet<Data*> toDelete;
+        Catalog catalog;
+        QVector<Catalog::Handle> data; // in display order
+        mutable SearchIndex searchIndex;
+        QSet<Catalog::Handle> toDelete;
         int current;
 
-        QList<int> history;
+        QList<Catalog::Handle> history;
 
         double slideShowInterval;
         int maxImages;
+        qint64 maxCacheBytes, cacheBytes, maxDiskCacheBytes;
         QString indexBuffer;
         QSet<FileNameThread*> fileNameThreads;
         QColor penColor;
@@ -167,7 +181,7 @@ private:
         //      const QString description;
         //  } shortcuts[]; // show info of all shortcuts on ?
 
-        QSet<ThumbLoaderThread*> thumbLoaderThreads;
+        ThumbLoader thumbLoader;
         ThumbInfo thumbLeft, thumbRight;
         int thumbMinWidth;
 
@@ -182,11 +196,25 @@ private:
         int minSize, maxSize;
         double quitTimerMinutes;
         int imagesInMemory;
+        int generation;
         QNetworkAccessManager *networkManager;
+        QList<Fetch> fetchQueue;
+        QHash<QNetworkReply*, Fetch> fetching;
         ImageLoaderThread imageLoaderThread;
+        QImage preview; // of the current image, while it's being decoded
+        QSize previewSize;
+        QImage scaled; // what paintEvent() last scaled an image to
+        qint64 scaledKey;
+        Catalog::Handle previewId;
         QPoint pressPosition;
         bool midButtonPressed;
         QVector<QRect> rects;
+        QTreeWidget *infoTree; // while showInfo() is up
+        double zoom; // 0 unless zoomed, the current image is drawn from tiles then
+        QSize zoomSize; // full size of the zoomed image
+        QCache<TileKey, QImage> tiles; // cost in KB
+        TileLoader tileLoader;
+        qint64 paintTime; // of the last paintEvent(), in ns
     } d;
 };
 